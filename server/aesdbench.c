@@ -0,0 +1,568 @@
+/**
+ * Load generator and latency benchmark for aesdsocket.
+ *
+ * build:
+ * make aesdbench
+ *
+ * run:
+ * ./aesdbench -c 100 -n 10000 -s 64
+ * ./aesdbench -c 1000 -n 100000 -s 512 -r 4 -t 8 --json >> bench.jsonl
+ * ./aesdbench -c 100 -n 100000 -k 1000    # against aesdsocket --keep-alive
+ *
+ * Every request opens a connection, sends the payload, half closes and reads the echo
+ * until the server closes. Latency is measured from connect() to the end of the echo.
+ *
+ * With --keep-alive a connection carries several requests one after the other. The
+ * payload's last record ends in a tag with the request number, the echo is complete once
+ * the tag came back. Latency is measured from the send, or connect() for the first
+ * request of a connection, to the tag.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pthread.h>
+
+// MARK: Defines
+#define DEFAULT_PORT "9000"
+#define DEFAULT_CONNECTIONS 100
+#define DEFAULT_REQUESTS 10000
+#define DEFAULT_PAYLOAD_SIZE 64
+#define DEFAULT_THREADS 4
+#define RECEIVE_BUFFER_SIZE (64 * 1024)
+#define EPOLL_MAX_EVENTS 256
+#define TAG_DIGITS 12
+#define TAG_LENGTH (TAG_DIGITS + 2)   // '#', the request number and the newline
+
+// MARK: Enums
+typedef enum result_s {
+    SUCCESS = 0,
+    FAILURE = 1
+} result_t;
+
+typedef enum bench_state_s {
+    BENCH_IDLE = 0,
+    BENCH_CONNECTING = 1,
+    BENCH_SENDING = 2,
+    BENCH_RECEIVING = 3
+} bench_state_t;
+
+// MARK: Structs
+typedef struct {
+    const char* host;
+    const char* port;
+    int connections;
+    int threads;
+    long requests;
+    size_t payload_size;
+    int records;
+    long keep_alive;          // requests per connection, 0 for one per connection
+    bool json;
+} bench_config_t;
+
+typedef struct {
+    int fd;
+    bench_state_t state;
+    long request;
+    uint64_t start_ns;
+    size_t sent;
+    char* payload;            // keep-alive: the payload tagged with the request number
+    long served;              // keep-alive: requests done on this connection
+    int tag_matched;          // keep-alive: bytes of the tag seen at the end of the echo so far
+} bench_connection_t;
+
+typedef struct {
+    int index;
+    int connections;
+    pthread_t thread_id;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    long completed;
+    long errors;
+} bench_thread_t;
+
+typedef struct {
+    bench_config_t config;
+    struct addrinfo* address;
+    char* payload;
+    long next_request;
+    uint64_t* latencies_ns;   // indexed by request, 0 for failed requests
+} bench_t;
+
+static bench_t g_bench;
+
+// MARK: Helpers
+
+uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// The payload is split into newline terminated records of (nearly) equal size, the
+// last byte is always a newline so the server echoes once per request.
+result_t build_payload(bench_t* bench) {
+    size_t size = bench->config.payload_size;
+    int records = bench->config.records;
+    bench->payload = malloc(size);
+    if (bench->payload == NULL) {
+        perror("malloc payload");
+        return(FAILURE);
+    }
+    for (size_t i = 0; i < size; i++) {
+        bench->payload[i] = 'a' + (i % 26);
+    }
+    for (int record = 1; record <= records; record++) {
+        bench->payload[size * record / records - 1] = '\n';
+    }
+    return SUCCESS;
+}
+
+// Keep-alive: the request number is unique and the only '#' in the history comes
+// right before one, so it can't show up in an echo before the end of this request's.
+void tag_payload(bench_connection_t* connection) {
+    char tag[TAG_LENGTH + 1];
+    snprintf(tag, sizeof(tag), "#%0*ld\n", TAG_DIGITS, connection->request);
+    memcpy(connection->payload + g_bench.config.payload_size - TAG_LENGTH, tag, TAG_LENGTH);
+    connection->tag_matched = 0;
+}
+
+// Keep-alive: look for the tag in what arrived, returns true once it's complete.
+bool match_tag(bench_connection_t* connection, const char* data, size_t length) {
+    const char* tag = connection->payload + g_bench.config.payload_size - TAG_LENGTH;
+    for (size_t i = 0; i < length; i++) {
+        // Most of an echo is other requests' records, skip ahead to the next tag.
+        if (connection->tag_matched == 0) {
+            const char* hash = memchr(data + i, '#', length - i);
+            if (hash == NULL) {
+                return false;
+            }
+            i = hash - data;
+        }
+        if (data[i] == tag[connection->tag_matched]) {
+            connection->tag_matched += 1;
+            if (connection->tag_matched == TAG_LENGTH) {
+                return true;
+            }
+        } else {
+            connection->tag_matched = data[i] == '#' ? 1 : 0;
+        }
+    }
+    return false;
+}
+
+void finish_request(bench_thread_t* thread, bench_connection_t* connection, bool ok) {
+    if (ok) {
+        g_bench.latencies_ns[connection->request] = now_ns() - connection->start_ns;
+        thread->completed += 1;
+    } else {
+        thread->errors += 1;
+    }
+    connection->state = BENCH_IDLE;
+    connection->served += 1;
+    if (ok && connection->served < g_bench.config.keep_alive) {
+        return;
+    }
+    if (connection->fd != -1) {
+        close(connection->fd);
+    }
+    connection->fd = -1;
+}
+
+// Claim the next request and start connecting, or sending right away on a kept alive
+// connection. Returns false once all requests are taken.
+bool start_request(int epoll_fd, bench_thread_t* thread, bench_connection_t* connection) {
+    while (true) {
+        long request = __atomic_fetch_add(&g_bench.next_request, 1, __ATOMIC_RELAXED);
+        if (request >= g_bench.config.requests) {
+            if (connection->fd != -1) {
+                close(connection->fd);
+                connection->fd = -1;
+            }
+            return false;
+        }
+        connection->request = request;
+        connection->sent = 0;
+        connection->start_ns = now_ns();
+        if (connection->payload != NULL) {
+            tag_payload(connection);
+        }
+        if (connection->fd != -1) {
+            connection->state = BENCH_SENDING;
+            return true;
+        }
+        connection->served = 0;
+
+        struct addrinfo* address = g_bench.address;
+        connection->fd = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK, address->ai_protocol);
+        if (connection->fd == -1) {
+            perror("socket");
+            thread->errors += 1;
+            continue;
+        }
+        if (connect(connection->fd, address->ai_addr, address->ai_addrlen) != 0 && errno != EINPROGRESS) {
+            finish_request(thread, connection, false);
+            continue;
+        }
+        connection->state = BENCH_CONNECTING;
+
+        struct epoll_event event = { 0 };
+        event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        event.data.ptr = connection;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection->fd, &event) != 0) {
+            perror("epoll_ctl");
+            finish_request(thread, connection, false);
+            continue;
+        }
+        return true;
+    }
+}
+
+// Drive one connection as far as it can go without blocking. Returns true when the
+// request finished, successfully or not.
+bool process_connection(bench_thread_t* thread, bench_connection_t* connection) {
+    if (connection->state == BENCH_CONNECTING) {
+        int error = 0;
+        socklen_t error_length = sizeof(error);
+        getsockopt(connection->fd, SOL_SOCKET, SO_ERROR, &error, &error_length);
+        if (error == EINPROGRESS) {
+            return false;
+        } else if (error != 0) {
+            finish_request(thread, connection, false);
+            return true;
+        }
+        connection->state = BENCH_SENDING;
+    }
+
+    if (connection->state == BENCH_SENDING) {
+        const char* payload = connection->payload != NULL ? connection->payload : g_bench.payload;
+        while (connection->sent < g_bench.config.payload_size) {
+            ssize_t sent = send(connection->fd, payload + connection->sent,
+                g_bench.config.payload_size - connection->sent, MSG_NOSIGNAL);
+            if (sent == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN) {
+                    return false;
+                } else if (errno == EINTR) {
+                    continue;
+                }
+                finish_request(thread, connection, false);
+                return true;
+            }
+            connection->sent += sent;
+            thread->bytes_sent += sent;
+        }
+        if (connection->payload == NULL) {
+            shutdown(connection->fd, SHUT_WR);
+        }
+        connection->state = BENCH_RECEIVING;
+    }
+
+    while (true) {
+        static __thread char receive_buffer[RECEIVE_BUFFER_SIZE];
+        ssize_t received = recv(connection->fd, receive_buffer, sizeof(receive_buffer), 0);
+        if (received == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return false;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            finish_request(thread, connection, false);
+            return true;
+        } else if (received == 0) {
+            // A kept alive connection closing before the tag is a failed request.
+            finish_request(thread, connection, connection->payload == NULL);
+            return true;
+        }
+        thread->bytes_received += received;
+        if (connection->payload != NULL && match_tag(connection, receive_buffer, received)) {
+            finish_request(thread, connection, true);
+            return true;
+        }
+    }
+}
+
+// Drive a connection through as many requests as it gets done without blocking, a kept
+// alive connection gets no new event to start the next one. Returns false once all
+// requests are taken.
+bool drive_connection(int epoll_fd, bench_thread_t* thread, bench_connection_t* connection) {
+    while (process_connection(thread, connection)) {
+        if (!start_request(epoll_fd, thread, connection)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void* manage_bench_thread(void* arg) {
+    bench_thread_t* thread = (bench_thread_t*) arg;
+    bench_connection_t* connections = calloc(thread->connections, sizeof(bench_connection_t));
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (connections == NULL || epoll_fd == -1) {
+        perror("bench thread setup");
+        free(connections);
+        return NULL;
+    }
+
+    int active = 0;
+    for (int i = 0; i < thread->connections; i++) {
+        connections[i].fd = -1;
+        if (g_bench.config.keep_alive > 0) {
+            connections[i].payload = malloc(g_bench.config.payload_size);
+            if (connections[i].payload == NULL) {
+                perror("malloc payload");
+                break;
+            }
+            memcpy(connections[i].payload, g_bench.payload, g_bench.config.payload_size);
+        }
+        if (start_request(epoll_fd, thread, &connections[i])) {
+            active += 1;
+        }
+    }
+
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    while (active > 0) {
+        int event_count = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, -1);
+        if (event_count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < event_count; i++) {
+            bench_connection_t* connection = (bench_connection_t*) events[i].data.ptr;
+            if (connection->state == BENCH_IDLE) {
+                continue;
+            }
+            if (!drive_connection(epoll_fd, thread, connection)) {
+                active -= 1;
+            }
+        }
+    }
+
+    close(epoll_fd);
+    for (int i = 0; i < thread->connections; i++) {
+        free(connections[i].payload);
+    }
+    free(connections);
+    return NULL;
+}
+
+// MARK: Report
+
+int compare_u64(const void* a, const void* b) {
+    uint64_t left = *(const uint64_t*) a;
+    uint64_t right = *(const uint64_t*) b;
+    return (left > right) - (left < right);
+}
+
+double percentile_us(const uint64_t* sorted, long count, double percentile) {
+    if (count == 0) {
+        return 0.0;
+    }
+    long index = (long) (percentile * (count - 1) + 0.5);
+    return sorted[index] / 1000.0;
+}
+
+void report(bench_t* bench, bench_thread_t* threads, double elapsed_s) {
+    uint64_t bytes_sent = 0;
+    uint64_t bytes_received = 0;
+    long completed = 0;
+    long errors = 0;
+    for (int i = 0; i < bench->config.threads; i++) {
+        bytes_sent += threads[i].bytes_sent;
+        bytes_received += threads[i].bytes_received;
+        completed += threads[i].completed;
+        errors += threads[i].errors;
+    }
+
+    // Failed requests left a zero behind, compact the successful ones before sorting.
+    long count = 0;
+    for (long i = 0; i < bench->config.requests; i++) {
+        if (bench->latencies_ns[i] != 0) {
+            bench->latencies_ns[count++] = bench->latencies_ns[i];
+        }
+    }
+    qsort(bench->latencies_ns, count, sizeof(uint64_t), compare_u64);
+
+    double requests_per_s = completed / elapsed_s;
+    double p50 = percentile_us(bench->latencies_ns, count, 0.50);
+    double p99 = percentile_us(bench->latencies_ns, count, 0.99);
+    double p999 = percentile_us(bench->latencies_ns, count, 0.999);
+    double max = count > 0 ? bench->latencies_ns[count - 1] / 1000.0 : 0.0;
+
+    if (bench->config.json) {
+        printf("{\"connections\":%d,\"threads\":%d,\"requests\":%ld,\"payload_size\":%zu,\"records\":%d,"
+            "\"keep_alive\":%ld,"
+            "\"completed\":%ld,\"errors\":%ld,\"elapsed_s\":%.6f,\"requests_per_s\":%.1f,"
+            "\"sent_bytes_per_s\":%.1f,\"received_bytes_per_s\":%.1f,"
+            "\"latency_us\":{\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}}\n",
+            bench->config.connections, bench->config.threads, bench->config.requests,
+            bench->config.payload_size, bench->config.records, bench->config.keep_alive, completed, errors, elapsed_s,
+            requests_per_s, bytes_sent / elapsed_s, bytes_received / elapsed_s, p50, p99, p999, max);
+    } else {
+        printf("requests:   %ld completed, %ld errors in %.3f s\n", completed, errors, elapsed_s);
+        printf("throughput: %.1f req/s, sent %.2f MB/s, received %.2f MB/s\n", requests_per_s,
+            bytes_sent / elapsed_s / 1e6, bytes_received / elapsed_s / 1e6);
+        printf("latency:    p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us (%s to echo)\n",
+            p50, p99, p999, max, bench->config.keep_alive > 0 ? "send" : "connect");
+    }
+}
+
+// MARK: Options
+
+static const struct option long_options[] = {
+    {"host", required_argument, NULL, 'H'},
+    {"port", required_argument, NULL, 'p'},
+    {"connections", required_argument, NULL, 'c'},
+    {"requests", required_argument, NULL, 'n'},
+    {"size", required_argument, NULL, 's'},
+    {"records", required_argument, NULL, 'r'},
+    {"threads", required_argument, NULL, 't'},
+    {"keep-alive", required_argument, NULL, 'k'},
+    {"json", no_argument, NULL, 'j'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0},
+};
+
+void print_usage(const char* program) {
+    fprintf(stderr,
+        "usage: %s [-H host] [-p port] [-c connections] [-n requests] [-s size] [-r records] [-t threads]\n"
+        "       [-k requests] [-j]\n"
+        "  -H, --host HOST         server address (default 127.0.0.1)\n"
+        "  -p, --port PORT         server port (default " DEFAULT_PORT ")\n"
+        "  -c, --connections N     concurrent connections (default %d)\n"
+        "  -n, --requests N        total requests (default %d)\n"
+        "  -s, --size BYTES        payload bytes per request, newlines included (default %d)\n"
+        "  -r, --records N         newline terminated records per payload (default 1)\n"
+        "  -t, --threads N         client threads (default %d)\n"
+        "  -k, --keep-alive N      send N requests per connection, for aesdsocket --keep-alive\n"
+        "  -j, --json              print one JSON object instead of the text report\n",
+        program, DEFAULT_CONNECTIONS, DEFAULT_REQUESTS, DEFAULT_PAYLOAD_SIZE, DEFAULT_THREADS);
+}
+
+result_t parse_options(bench_config_t* config, int argc, char* argv[]) {
+    config->host = "127.0.0.1";
+    config->port = DEFAULT_PORT;
+    config->connections = DEFAULT_CONNECTIONS;
+    config->threads = DEFAULT_THREADS;
+    config->requests = DEFAULT_REQUESTS;
+    config->payload_size = DEFAULT_PAYLOAD_SIZE;
+    config->records = 1;
+    config->keep_alive = 0;
+    config->json = false;
+
+    int option;
+    while ((option = getopt_long(argc, argv, "H:p:c:n:s:r:t:k:jh", long_options, NULL)) != -1) {
+        switch (option) {
+            case 'H':
+                config->host = optarg;
+                break;
+            case 'p':
+                config->port = optarg;
+                break;
+            case 'c':
+                config->connections = atoi(optarg);
+                break;
+            case 'n':
+                config->requests = atol(optarg);
+                break;
+            case 's':
+                config->payload_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                config->records = atoi(optarg);
+                break;
+            case 't':
+                config->threads = atoi(optarg);
+                break;
+            case 'k':
+                config->keep_alive = atol(optarg);
+                if (config->keep_alive <= 0) {
+                    fprintf(stderr, "invalid keep-alive request count: %s\n", optarg);
+                    return(FAILURE);
+                }
+                break;
+            case 'j':
+                config->json = true;
+                break;
+            default:
+                return(FAILURE);
+        }
+    }
+
+    if (config->connections <= 0 || config->threads <= 0 || config->requests <= 0 || config->records <= 0
+            || config->payload_size < (size_t) config->records) {
+        fprintf(stderr, "counts must be positive and size must be at least the record count\n");
+        return(FAILURE);
+    }
+    if (config->keep_alive > 0 && config->payload_size / config->records < TAG_LENGTH) {
+        fprintf(stderr, "keep-alive needs records of at least %d bytes for the tag\n", TAG_LENGTH);
+        return(FAILURE);
+    }
+    if (config->threads > config->connections) {
+        config->threads = config->connections;
+    }
+    return SUCCESS;
+}
+
+// MARK: main
+
+int main(int argc, char* argv[]) {
+    if (parse_options(&g_bench.config, argc, argv) == FAILURE) {
+        print_usage(argv[0]);
+        exit(-1);
+    }
+
+    struct addrinfo hints = { 0 };
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int gai_result = getaddrinfo(g_bench.config.host, g_bench.config.port, &hints, &g_bench.address);
+    if (gai_result != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(gai_result));
+        exit(-1);
+    }
+
+    g_bench.latencies_ns = calloc(g_bench.config.requests, sizeof(uint64_t));
+    bench_thread_t* threads = calloc(g_bench.config.threads, sizeof(bench_thread_t));
+    if (g_bench.latencies_ns == NULL || threads == NULL || build_payload(&g_bench) == FAILURE) {
+        perror("calloc");
+        exit(-1);
+    }
+
+    uint64_t start_ns = now_ns();
+    for (int i = 0; i < g_bench.config.threads; i++) {
+        threads[i].index = i;
+        // Spread the connections evenly, the first threads take the remainder.
+        threads[i].connections = g_bench.config.connections / g_bench.config.threads
+            + (i < g_bench.config.connections % g_bench.config.threads ? 1 : 0);
+        if (pthread_create(&threads[i].thread_id, NULL, manage_bench_thread, &threads[i]) != 0) {
+            perror("pthread_create");
+            exit(-1);
+        }
+    }
+    for (int i = 0; i < g_bench.config.threads; i++) {
+        pthread_join(threads[i].thread_id, NULL);
+    }
+    double elapsed_s = (now_ns() - start_ns) / 1e9;
+
+    report(&g_bench, threads, elapsed_s);
+
+    freeaddrinfo(g_bench.address);
+    free(g_bench.latencies_ns);
+    free(g_bench.payload);
+    free(threads);
+    return 0;
+}
@@ -2,11 +2,16 @@
  * build:
  * make clean && make all && ./aesdsocket
  * make clean && make all && ./aesdsocket -d
+ * make clean && make all && ./aesdsocket -m thread
+ * make clean && make all && ./aesdsocket -m epoll -n 4
+ * make clean && make all && ./aesdsocket -m epoll -n 4 --reuseport --backlog 4096
+ * make clean && make all && ./aesdsocket -m uring -n 4
  * valgrind ./aesdsocket
  *
  * test/debug:
  * echo "test" | nc 127.0.0.1 9000
  * echo "The quick brown fox jumps over the lazy dog" | nc 127.0.0.1 9000
+ * echo "AESDCHAR_IOCSEEKTO:1,2" | nc 127.0.0.1 9000   # history from byte 2 of record 1 on
  * ./assignment-autotest/test/assignment5/sockettest.sh
  * journalctl SYSLOG_IDENTIFIER=aesdsocket -p debug
  * journalctl SYSLOG_IDENTIFIER=aesdsocket -p debug -f
@@ -16,30 +21,109 @@
  * pkill aesdsocket
  */
 
+// accept4(), CPU affinity
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <net/if.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
+#include <linux/io_uring.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include <pthread.h>
+#include <sched.h>
 
 #include "queue.h"
 
 // MARK: Defines
-#define RECEIVE_BUFFER_SIZE 4096
-#define SEND_BUFFER_SIZE 4096
+#define RECEIVE_BUFFER_SIZE (64 * 1024)
+#define RECEIVE_BUFFERS 4
+#define RECEIVE_CHAIN_MAX 64
+#define SEND_BUFFER_SIZE (64 * 1024)  // file store pread() path, read per send()
+#define HISTORY_SEND_IOVS 16          // memory store segments gathered into one sendmsg()
+#define DATA_FILE_DIR "/var/tmp"
+#define DATA_FILE_NAME "aesdsocketdata"
+#define DATA_FILE_PATH DATA_FILE_DIR "/" DATA_FILE_NAME
+#define SEGMENT_FILE_FORMAT DATA_FILE_PATH ".%08zu"
+#define SEGMENT_FILE_PATH_MAX 64
+#define DEFAULT_SEGMENT_SIZE (4 * 1024 * 1024)
+#define MIN_SEGMENT_SIZE (64 * 1024)
+#define INDEX_FILE_PATH DATA_FILE_PATH ".idx"
+#define EPOLL_MAX_EVENTS 64
+#define DEFAULT_EVENT_LOOP_THREADS 4
+#define DEFAULT_POOL_WORKERS 16
+#define DEFAULT_ACCEPT_QUEUE_DEPTH 256
+#define DEFAULT_LISTEN_BACKLOG 1024   // capped by net.core.somaxconn
+#define HISTORY_SEGMENT_SIZE (64 * 1024)
+#define HISTORY_TABLE_BLOCK_SIZE 65536    // entries per block of a history_table_t
+#define HISTORY_TABLE_BLOCKS 4096         // so up to 2^28 records or segments at a time
+#define HISTORY_MAP_CHUNK_SIZE (64 * 1024 * 1024)   // file store mmap() reads map this much at a time
+#define HISTORY_MAP_CHUNKS 4096                     // so up to 256GB of data file
+#define SEEK_COMMAND "AESDCHAR_IOCSEEKTO:"
+#define SEEK_COMMAND_MAX 64
+#define METRICS_HISTOGRAM_BUCKETS 24  // <= 1us, 2us, 4us ... 2^22us (~4s), +Inf
+#define LOG_RING_SLOTS 256
+#define LOG_MESSAGE_SIZE 240
+#define LOG_DRAIN_INTERVAL_US 10000
+#define DEFAULT_LOG_PAYLOAD_MAX 64
+#define DEFAULT_DRAIN_TIMEOUT 10      // seconds open connections get to finish on shutdown
+#define HISTORY_FLUSH_TIMEOUT_MS 1000
+#define HISTORY_BATCH_IOVS 64         // segment spans per write behind pwritev()
+#define DEFAULT_SYNC_INTERVAL_MS 100
+#define DEFAULT_IDLE_TIMEOUT 30       // seconds a keep-alive connection may sit between packets
+#define DEFAULT_MAX_RECORD (1024 * 1024)  // longest record, so also what a connection may stage
+#define STAGING_MIN_CAPACITY 4096
+#define RATE_LIMIT_SLOTS 256          // locked hash slots of the per-client token buckets
+#define NEWLINE_BLOCK 64              // bytes per newline scan, one bit each in the mask
+#define HOUSEKEEPING_JOBS_MAX 8
+#define POOL_SLAB_OBJECTS 64          // objects carved out of each slab of an object pool
+#define ARENA_ALIGNMENT 64
+#define TIMESTAMP_INTERVAL_MS 10000
+#define INDEX_SYNC_INTERVAL_MS 1000
+#define URING_ENTRIES 1024            // submission queue entries per ring
+#define URING_FILES 4096              // fixed file slots per ring for accepted sockets
+#define URING_RECV_BUFFERS 64         // provided receive buffers per ring, a power of 2
+#define URING_READ_BUFFERS 16         // registered buffers per ring for file store reads
+#define URING_READ_BUFFER_SIZE (64 * 1024)
+#define URING_BUFFER_GROUP 0
+#define URING_OP_MASK 7               // user_data is a connection pointer with the op in the low bits
+
+// Messages above this level are compiled out entirely, e.g. -DLOG_COMPILE_LEVEL=LOG_INFO
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_DEBUG
+#endif
 
 // MARK: Enums
 typedef enum result_s {
@@ -47,32 +131,510 @@ typedef enum result_s {
     FAILURE = 1
 } result_t;
 
+typedef enum server_mode_s {
+    SERVER_MODE_EPOLL = 0,  // a few event loop threads multiplexing non-blocking sockets
+    SERVER_MODE_THREAD = 1, // original thread-per-connection model
+    SERVER_MODE_POOL = 2,   // fixed worker pool fed by a bounded queue of accepted sockets
+    SERVER_MODE_URING = 3   // event loops submitting to io_uring instead of waiting on epoll
+} server_mode_t;
+
+typedef enum history_store_s {
+    HISTORY_STORE_MEMORY = 0,  // segmented in-memory log, the data file is written behind
+    HISTORY_STORE_FILE = 1     // the data file itself is the log
+} history_store_t;
+
+typedef enum history_read_s {
+    HISTORY_READ_SENDFILE = 0, // the kernel moves page cache pages to the socket
+    HISTORY_READ_PREAD = 1,    // pread() into a bounce buffer and send() that
+    HISTORY_READ_MMAP = 2      // send() straight out of the data file mapped in chunks
+} history_read_t;
+
+typedef enum history_sync_s {
+    HISTORY_SYNC_NONE = 0,     // leave writeback to the kernel, echoes don't wait for the disk
+    HISTORY_SYNC_BATCH = 1,    // fdatasync() after every batch
+    HISTORY_SYNC_INTERVAL = 2  // fdatasync() at most once per sync interval
+} history_sync_t;
+
+typedef enum connection_state_s {
+    CONNECTION_RECEIVING = 0,  // appending received data until the packet's newline
+    CONNECTION_SENDING = 1,    // echoing the history back to the peer
+    CONNECTION_FOLLOWING = 2,  // tail mode: streaming whatever is appended after the echo
+    CONNECTION_SYNCING = 3,    // waiting for the packet to be durable before the echo
+    CONNECTION_CLOSED = 4
+} connection_state_t;
+
+typedef enum uring_op_s {
+    URING_OP_ACCEPT = 1,
+    URING_OP_RECV = 2,
+    URING_OP_READ = 3,        // file store: history into a registered buffer, linked to a send
+    URING_OP_SEND = 4,
+    URING_OP_CLOSE = 5,
+    URING_OP_SHUTDOWN = 6,    // poll on shutdown_fd
+    URING_OP_NONE = 7         // cancels and link timeouts, nothing to do once they complete
+} uring_op_t;
+
 // MARK: Structs
 typedef struct addrinfo addrinfo_t;
 typedef struct sockaddr_in sockaddr_in_t;
 
+// Bump allocator over one block. Everything carved out of it is given back at once by
+// resetting it, the block itself is kept for the next user.
+typedef struct {
+    char* base;
+    size_t size;
+    size_t used;
+} arena_t;
+
+// Free list of fixed size objects carved out of slabs that are never handed back to the
+// heap, so once warmed up getting and putting an object is a pointer swap. The mutex is
+// only taken by pools shared between threads. A free object's first pointer holds the
+// free list link, everything behind it survives until the object is reused.
+typedef struct {
+    size_t object_size;
+    void* free;
+    size_t objects;           // carved so far
+    bool shared;
+    pthread_mutex_t mutex;
+} object_pool_t;
+
+// Connection of the thread per connection mode, pooled along with its arena.
 typedef struct connection_entry_s {
-    int value;
+    struct connection_entry_s* next_free;     // object pool link
     uint32_t id;
     int peer_fd;
     pthread_t thread_id;
-    bool done;
-    SLIST_ENTRY(connection_entry_s) entries;
+    uint64_t handle;          // registry slot and generation
+    arena_t arena;            // the connection thread's receive buffers
+    struct connection_entry_s* next_completed;
 } connection_entry_t;
 
+typedef struct {
+    connection_entry_t* entry;    // NULL while the slot is free
+    uint32_t generation;          // bumped whenever the slot is released, stale handles stop matching
+    uint32_t next_free;
+} registry_slot_t;
+
+// Live connection threads by handle, the slot index in the low half and the slot's
+// generation in the high half. Only the acceptor touches the slots. Finishing threads
+// push their entry onto the lock free completed stack and the acceptor takes all of it
+// at once, so reaping is O(completed) and nobody waits on anybody.
+typedef struct {
+    registry_slot_t* slots;
+    uint32_t capacity;
+    uint32_t free_head;           // REGISTRY_SLOT_NONE if every slot is taken
+    uint32_t live;
+    connection_entry_t* completed;
+} connection_registry_t;
+
+#define REGISTRY_SLOT_NONE UINT32_MAX
+
+typedef struct {
+    int level;
+    char message[LOG_MESSAGE_SIZE];
+} log_entry_t;
+
+// Single producer (the owning thread), single consumer (the log thread) ring. Like the
+// metrics blocks, rings of exited threads are recycled by new threads.
+typedef struct log_ring_s {
+    uint32_t head;
+    uint32_t tail;
+    uint64_t dropped;
+    uint64_t dropped_reported;
+    uint32_t payloads_seen;
+    struct log_ring_s* next;
+    struct log_ring_s* next_free;
+    log_entry_t entries[LOG_RING_SLOTS];
+} log_ring_t;
+
+typedef struct {
+    pthread_mutex_t registry_mutex;
+    pthread_mutex_t drain_mutex;  // the log thread and shutdown both drain
+    pthread_key_t thread_key;
+    log_ring_t* rings;
+    log_ring_t* free_rings;
+    size_t payload_max;
+    int sample;
+} aesdsocket_log_t;
+
+typedef struct {
+    uint64_t buckets[METRICS_HISTOGRAM_BUCKETS];
+    uint64_t sum_ns;
+    uint64_t count;
+} metrics_histogram_t;
+
+// Counters only ever written by the thread that owns them, so updates are uncontended.
+// Blocks of exited threads go on a free list and the next new thread keeps adding to
+// them, exported values are sums over every block ever registered.
+typedef struct thread_metrics_s {
+    uint64_t connections_opened;
+    uint64_t connections_closed;
+    uint64_t connections_rejected;
+    uint64_t accept_errors;
+    uint64_t records_rejected;
+    uint64_t reads_throttled;
+    uint64_t bytes_received;
+    uint64_t bytes_sent;
+    uint64_t history_writes;
+    uint64_t history_syncs;
+    metrics_histogram_t append_latency;
+    metrics_histogram_t echo_latency;
+    struct thread_metrics_s* next;
+    struct thread_metrics_s* next_free;
+} thread_metrics_t;
+
 typedef struct {
     uint32_t total_connections;
+    pthread_mutex_t registry_mutex;
+    pthread_key_t thread_key;
+    thread_metrics_t* threads;
+    thread_metrics_t* free_threads;
+    int server_fd;
 } aesdsocket_metrics_t;
 
+// Received data is kept in fixed size segments that are never moved or modified once
+// written, so readers can send straight out of them without holding the history lock.
+typedef struct history_segment_s {
+    struct history_segment_s* next;
+    char data[HISTORY_SEGMENT_SIZE];
+} history_segment_t;
+
+// Append-only table whose entries never move once written, so readers can look up
+// anything from first to below count without a lock. Appends must be serialized by the
+// caller. Blocks go around in a ring: once trimmed, a block is recycled for later entries
+// but never freed, so a reader racing the trim reads a stale value rather than faulting
+// and has to check first again after the read.
+typedef struct {
+    uint64_t* blocks[HISTORY_TABLE_BLOCKS];
+    size_t count;
+    size_t first;             // entries below were trimmed, always at a block boundary
+    uint64_t* spare;          // trimmed blocks, chained through their first entry
+} history_table_t;
+
+// One segment file of a segmented file store. Readers hold a reference while they send
+// out of it. Once retention dropped it, whoever lets go of it last closes it. Like the
+// watchers these are never freed, a reader may still look one up after it was dropped.
+typedef struct {
+    int fd;
+    uint64_t refs;            // readers, plus HISTORY_FILE_DROPPED and HISTORY_FILE_CLOSED
+    char* map;                // mmap() reads, the whole segment
+} history_file_t;
+
+#define HISTORY_FILE_DROPPED (1ULL << 63)
+#define HISTORY_FILE_CLOSED (1ULL << 62)
+
+// Someone streaming the history as it grows. Publishers write the eventfd when the history
+// grows, pending skips the write while an earlier wakeup hasn't been consumed yet. Like
+// the metrics blocks, watchers are never unlinked, unused ones are recycled.
+typedef struct history_watcher_s {
+    int event_fd;
+    bool active;
+    bool pending;
+    struct history_watcher_s* next;
+    struct history_watcher_s* next_free;
+} history_watcher_t;
+
+// Appenders reserve a range, write it without holding any lock and then publish it.
+// length only ever covers fully written bytes, so readers snapshot it and stream
+// everything below it lock free.
+typedef struct {
+    history_store_t store;
+    pthread_mutex_t mutex;    // segment and segment file allocation and persist_cond only
+    size_t reserved;
+    size_t length;
+    size_t published;         // end of the appends through their publish turn, written or not
+    bool write_failed;        // file store: an append failed to write, length stops there
+    pthread_mutex_t publish_mutex;    // appenders waiting for their publish turn
+    pthread_cond_t publish_cond;
+    int publish_waiters;      // publishers only take the mutex to wake someone while this isn't 0
+    int data_fd;
+    history_read_t read_path;     // file store: falls back to pread() if sendfile() or mmap() fail
+    char* maps[HISTORY_MAP_CHUNKS];   // file store mmap() reads, each chunk mapped on first use
+    pthread_mutex_t maps_mutex;
+    // memory store
+    history_segment_t* head;
+    history_segment_t* tail;
+    size_t tail_used;
+    // write behind of the memory store to the data file
+    bool persist;
+    size_t persisted;
+    bool persist_waiting;
+    pthread_cond_t persist_cond;
+    pthread_t persist_thread;
+    // group commit, only the persist thread moves durable
+    history_sync_t sync;
+    uint64_t sync_interval_ns;
+    size_t durable;               // bytes written and synced under the sync policy
+    bool sync_failed;
+    pthread_cond_t durable_cond;
+    history_table_t segments;     // memory store: every segment in order, for seeking
+    // file store split into segment files, segment_size is 0 for the single data file
+    size_t segment_size;
+    history_table_t files;        // history_file_t* by segment number, NULL below the first
+    size_t dropped_segments;      // segments below this are unlinked
+    size_t retain_bytes;          // retention caps, 0 for no cap
+    size_t retain_records;
+    size_t start;                 // first retained byte, always a record boundary
+    size_t start_record;          // number of the first retained record
+    // record index, the end offset of every newline terminated record
+    history_table_t records;
+    bool index_full;
+    bool persist_index;
+    int index_fd;                 // sidecar file with the records table
+    size_t index_written;         // records already in the sidecar
+    pthread_mutex_t index_file_mutex;
+    // tail mode
+    pthread_mutex_t watchers_mutex;
+    history_watcher_t* watchers;
+    history_watcher_t* free_watchers;
+    int active_watchers;      // publishers skip walking the list while this is 0
+} history_t;
+
+// Packet framing. Every newline a connection appends completes one of its packets, wherever
+// it sits in a read, and each packet gets its own echo up to and including that newline.
+// Without keep-alive they all go out in one echo before the close. The record index
+// already holds those ends, so nothing is scanned twice: a connection only remembers the
+// next record to echo and where its last append ended, and doesn't read again before all
+// of them were echoed.
+typedef struct {
+    size_t next_record;
+    size_t appended_end;
+    size_t fallback_end;      // echo end while the record index is full, 0 for none
+    bool whole;               // one echo through the end of each append, no per packet ones
+} pipeline_t;
+
+// Position of a reader in the history. The segment fields are only used by the
+// memory store.
+typedef struct {
+    size_t offset;
+    history_segment_t* segment;
+    size_t segment_offset;
+} history_cursor_t;
+
+typedef struct {
+    bool daemon_mode;
+    server_mode_t mode;
+    history_store_t store;
+    bool persist;             // memory store: write the history behind to the data file
+    history_read_t read_path; // file store: how echoes read the data file
+    size_t segment_size;      // file store: split the log into files this big, 0 for one file
+    size_t retain_bytes;      // file store: drop the oldest records beyond these caps
+    size_t retain_records;
+    history_sync_t sync;      // when to fdatasync() the data file, echoes wait for it
+    int sync_interval_ms;
+    int log_level;
+    size_t log_payload_max;   // bytes of each received payload to log, 0 for none
+    int log_sample;           // log one in every log_sample payloads
+    const char* metrics_port;     // local TCP port for the metrics endpoint
+    const char* metrics_socket;   // or a unix socket path
+    int threads;              // event loops or pool workers, 0 picks the mode's default
+    int accept_queue_depth;
+    bool reject_when_full;    // close new connections instead of blocking the acceptor
+    size_t receive_buffer_size;
+    int receive_buffers;      // buffers chained into each readv()
+    int drain_timeout;        // seconds to let open connections finish after SIGINT/SIGTERM
+    int listen_backlog;
+    bool reuseport;           // epoll mode: a SO_REUSEPORT listener per loop, loops pinned to CPUs
+    int socket_send_buffer;   // SO_SNDBUF of the listener, inherited when accepting, 0 for the default
+    int socket_receive_buffer;    // SO_RCVBUF, likewise
+    int nodelay;              // TCP_NODELAY on the listener, -1 for only with keep-alive
+    int defer_accept;         // TCP_DEFER_ACCEPT seconds, 0 to accept on the handshake
+    bool tail;                // keep connections open after the echo, streaming new data
+    bool persist_index;       // file store: keep the record index in a sidecar file
+    bool keep_alive;          // serve any number of packets per connection
+    int idle_timeout;         // keep-alive: seconds between packets before closing, 0 for never
+    size_t max_record;        // longest record a connection may send, longer ones close it
+    size_t rate_bytes;        // per client address bytes/s, 0 for no limit
+    size_t rate_records;      // per client address records/s, 0 for no limit
+} aesdsocket_config_t;
+
+// Separately allocated receive buffers filled by a single readv(), so one syscall can
+// take in receive_buffers * receive_buffer_size bytes.
+typedef struct {
+    struct iovec iov[RECEIVE_CHAIN_MAX];
+    int count;
+} receive_chain_t;
+
+// Token buckets of one client address, shared by all of its connections. They refill at
+// the per second rates up to one second's worth. Reads are charged once they're done, a
+// bucket in debt keeps its connections from reading until it's paid off.
+typedef struct rate_bucket_s {
+    struct in6_addr address;  // IPv4 peers as ::ffff:a.b.c.d
+    int users;                // connections holding it
+    double bytes;
+    double records;
+    uint64_t refill_ns;
+    struct rate_slot_s* slot;
+    struct rate_bucket_s* next;
+} rate_bucket_t;
+
+typedef struct rate_slot_s {
+    pthread_mutex_t mutex;
+    rate_bucket_t* buckets;
+} rate_slot_t;
+
+typedef struct {
+    size_t bytes_per_second;
+    size_t records_per_second;
+    rate_slot_t slots[RATE_LIMIT_SLOTS];
+} rate_limiter_t;
+
+// Unfinished record of a connection. Only complete records are appended, so a peer that
+// never sends a newline holds up nobody else and costs at most max_record bytes.
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+} staging_t;
+
+typedef struct {
+    int index;
+    int epoll_fd;
+    int server_fd;            // the shared listener, or the loop's own one with reuseport
+    pthread_t thread_id;
+    receive_chain_t receive_chain;
+    object_pool_t connection_pool;
+    history_watcher_t* watcher;   // active while following or syncing isn't empty
+    bool watching;
+    LIST_HEAD(following_head, connection_s) following;
+    LIST_HEAD(syncing_head, connection_s) syncing;
+    TAILQ_HEAD(idle_head, connection_s) idle;     // keep-alive: least recently active first
+    LIST_HEAD(throttled_head, connection_s) throttled;
+    int connections;          // only touched by the loop's own thread
+    bool draining;            // stopped accepting, exits once connections reaches 0
+} event_loop_t;
+
+// Per-connection state machine used by the event loop mode. The history cursor lets a
+// partially sent echo resume when the socket is writable again.
+typedef struct connection_s {
+    uint32_t id;
+    int peer_fd;
+    connection_state_t state;
+    history_cursor_t cursor;
+    size_t send_end;
+    uint64_t echo_start_ns;
+    staging_t staging;        // received bytes of the packet in progress
+    bool following;           // linked into its loop's following list
+    pipeline_t pipeline;
+    bool echoed;              // keep-alive: at least one packet was echoed
+    uint64_t active_ns;       // keep-alive: last time anything happened
+    rate_bucket_t* rate_bucket;   // NULL without rate limits
+    uint64_t throttled_ns;    // rate limited: when reading resumes, 0 while not throttled
+    LIST_ENTRY(connection_s) following_entries;
+    LIST_ENTRY(connection_s) syncing_entries;
+    TAILQ_ENTRY(connection_s) idle_entries;
+    LIST_ENTRY(connection_s) throttled_entries;
+} connection_t;
+
+// Submission and completion rings of one io_uring, mapped the way io_uring_setup(2)
+// describes. Only the owning thread touches them, so there's no locking.
+typedef struct {
+    int ring_fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_pending_tail; // sqes handed out, the kernel sees them on the next submit
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    void* ring_map;
+    size_t ring_map_size;
+    size_t sqes_map_size;
+} uring_t;
+
+// Connection of the io_uring mode. Completions still in flight point at it, so it's only
+// freed once the last one came back.
+typedef struct uring_connection_s {
+    uint32_t id;
+    int fd;                   // fixed file slot, or a plain descriptor if fixed is false
+    bool fixed;
+    connection_state_t state;
+    history_cursor_t cursor;
+    size_t send_end;
+    uint64_t echo_start_ns;
+    staging_t staging;
+    int inflight;             // submitted ops without a completion yet
+    bool closing;             // close once inflight drops to 0
+    int read_buffer;          // registered buffer of the read and send in flight, -1 for none
+    size_t read_length;
+    history_file_t* read_file;    // segment file the read in flight holds a reference on
+    pipeline_t pipeline;
+    bool echoed;              // keep-alive: at least one packet was echoed
+    bool idle;                // keep-alive: waiting for the next packet, linked into idle
+    rate_bucket_t* rate_bucket;
+    struct __kernel_timespec throttle;    // rate limited: delay before the next receive
+    STAILQ_ENTRY(uring_connection_s) waiting_entries;
+    LIST_ENTRY(uring_connection_s) idle_entries;
+} uring_connection_t;
+
+typedef struct {
+    int index;
+    pthread_t thread_id;
+    uring_t ring;
+    struct io_uring_buf_ring* recv_ring;  // provided buffers the kernel picks for receives
+    char* recv_buffers;
+    size_t recv_buffer_size;
+    unsigned short recv_tail;
+    char* read_buffers;       // registered, file store reads land here
+    int free_reads[URING_READ_BUFFERS];
+    int free_read_count;
+    STAILQ_HEAD(waiting_head, uring_connection_s) waiting;    // echoes waiting for a read buffer
+    LIST_HEAD(uring_idle_head, uring_connection_s) idle;      // closed right away on drain
+    struct __kernel_timespec idle_timeout;    // linked to every keep-alive receive
+    object_pool_t connection_pool;
+    int connections;          // only touched by the loop's own thread
+    bool accepting;           // an accept is in flight
+    struct sockaddr_storage accept_address;   // peer of the accept in flight
+    socklen_t accept_address_length;
+    bool accept_paused;       // out of descriptors, accept again after the next close
+    bool direct_accept;       // accept into fixed file slots, off while they're all taken
+    bool draining;
+} uring_loop_t;
+
+struct aesdsocket_s;
+
+// Periodic job of the housekeeping thread, driven by its own timerfd.
+typedef struct {
+    const char* name;
+    int interval_ms;
+    void (*run)(struct aesdsocket_s* aesdsocket);
+    int timer_fd;
+} housekeeping_job_t;
+
+// One thread waiting on the timerfds of every periodic job, so a tick costs a read()
+// instead of a thread. Jobs run one at a time, a slow one only delays the others.
 typedef struct {
+    pthread_t thread_id;
+    int epoll_fd;
+    int stop_fd;              // eventfd, cleanup writes it to stop the thread
+    housekeeping_job_t jobs[HOUSEKEEPING_JOBS_MAX];
+    int job_count;
+    time_t clock_second;      // second the cached clock was formatted for
+    char clock[64];
+} housekeeping_t;
+
+typedef struct aesdsocket_s {
+    aesdsocket_config_t config;
     int server_fd;
     struct addrinfo* address;
-    pthread_mutex_t file_mutex;
-    pthread_mutex_t connections_mutex;
-    pthread_t timestamp_thread;
+    history_t history;
+    housekeeping_t housekeeping;
     aesdsocket_metrics_t metrics;
+    aesdsocket_log_t log;
     int connections_count;
-    SLIST_HEAD(slisthead, connection_entry_s) connections;
+    connection_registry_t registry;
+    object_pool_t entry_pool;
+    rate_limiter_t rate_limiter;
+    event_loop_t* event_loops;
+    uring_loop_t* uring_loops;
+    // shutdown
+    int signal_fd;
+    int shutdown_fd;          // eventfd, readable once shutdown was requested
+    bool shutting_down;
+    int acceptors;            // threads still accepting, the last one closes server_fd
 } aesdsocket_t;
 
 typedef struct {
@@ -80,6 +642,17 @@ typedef struct {
     int peer_fd;
 } connection_thread_args_t;
 
+// Bounded multi-producer/multi-consumer ring of accepted sockets waiting for a worker.
+typedef struct {
+    connection_thread_args_t* entries;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} accept_queue_t;
+
 
 
 // globals - Only accessed in the main entry point and cleanup/shutdown code.
@@ -90,6 +663,11 @@ static aesdsocket_t g_aesdsocket;
 
 // forward declarations
 static void cleanup_and_exit(aesdsocket_t* aesdsocket);
+void history_flush(history_t* history, int timeout_ms);
+void history_files_remove(history_t* history);
+void history_notify_watchers(history_t* history);
+void housekeeping_stop(housekeeping_t* housekeeping);
+void uring_echoed(aesdsocket_t* aesdsocket, uring_loop_t* loop, uring_connection_t* connection);
 
 // MARK: signal handling
 #define MAX_SIGNAL_NAME_LENGTH 32
@@ -100,22 +678,10 @@ typedef struct signal_handler_s {
     void (* callback)(int);
 } signal_handler_t;
 
-void sigint_handler(int signum) {
-    syslog(LOG_INFO, "Caught signal, exiting");
-    syslog(LOG_DEBUG, "SIGINT (2)");
-    cleanup_and_exit(&g_aesdsocket);
-}
-
-void sigterm_handler(int signum) {
-    syslog(LOG_INFO, "Caught signal, exiting");
-    syslog(LOG_DEBUG, "SIGTERM (15)");
-    cleanup_and_exit(&g_aesdsocket);
-}
-
-static const int signal_handler_table_size = 2;
+static const int signal_handler_table_size = 1;
 static const signal_handler_t signal_handler_table[] = {
-    {SIGINT, "SIGINT", 0, sigint_handler},
-    {SIGTERM, "SIGTERM", 0, sigterm_handler},
+    // sendfile() has no MSG_NOSIGNAL, a peer closing early must not kill the server.
+    {SIGPIPE, "SIGPIPE", 0, SIG_IGN},
 };
 
 void register_signal_handlers() {
@@ -132,21 +698,386 @@ void register_signal_handlers() {
     }
 }
 
-// MARK: Business Logic Start
+// SIGINT and SIGTERM are blocked in every thread and read from a signalfd by the signal
+// thread, so shutdown runs as ordinary code instead of inside a handler. Must be called
+// before any thread is created, threads inherit the mask.
+result_t block_shutdown_signals(sigset_t* signals) {
+    sigemptyset(signals);
+    sigaddset(signals, SIGINT);
+    sigaddset(signals, SIGTERM);
+    if (pthread_sigmask(SIG_BLOCK, signals, NULL) != 0) {
+        perror("pthread_sigmask");
+        return(FAILURE);
+    }
+    return SUCCESS;
+}
 
-result_t start_listen_server(int* server_fd, struct addrinfo** address, socklen_t* address_length) {
-    addrinfo_t address_hints;
+// MARK: Logging
 
-    memset(&address_hints, 0, sizeof(address_hints));
-    address_hints.ai_family = AF_UNSPEC;
-    address_hints.ai_socktype = SOCK_STREAM;
-    address_hints.ai_flags = AI_PASSIVE;
-    if (getaddrinfo(NULL, "9000", &address_hints, address) != 0) {
-        perror("getaddrinfo");
+// Runtime filter, checked before anything is formatted.
+static int g_log_level = LOG_INFO;
+static __thread log_ring_t* t_log_ring = NULL;
+
+void log_enqueue(int level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+// Hot path logging. Messages are formatted into the calling thread's ring and written
+// to syslog by the log thread, a full ring drops the message instead of blocking.
+#define AESD_LOG(level, ...) \
+    do { \
+        if ((level) <= LOG_COMPILE_LEVEL && (level) <= g_log_level) { \
+            log_enqueue((level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+void log_release_ring(void* arg) {
+    log_ring_t* ring = (log_ring_t*) arg;
+    pthread_mutex_lock(&g_aesdsocket.log.registry_mutex);
+    ring->next_free = g_aesdsocket.log.free_rings;
+    g_aesdsocket.log.free_rings = ring;
+    pthread_mutex_unlock(&g_aesdsocket.log.registry_mutex);
+}
+
+log_ring_t* log_thread_ring() {
+    if (t_log_ring != NULL) {
+        return t_log_ring;
+    }
+
+    aesdsocket_log_t* log = &g_aesdsocket.log;
+    pthread_mutex_lock(&log->registry_mutex);
+    log_ring_t* ring = log->free_rings;
+    if (ring != NULL) {
+        log->free_rings = ring->next_free;
+    } else {
+        ring = calloc(1, sizeof(log_ring_t));
+        if (ring != NULL) {
+            ring->next = log->rings;
+            log->rings = ring;
+        }
+    }
+    pthread_mutex_unlock(&log->registry_mutex);
+
+    if (ring != NULL) {
+        pthread_setspecific(log->thread_key, ring);
+    }
+    t_log_ring = ring;
+    return ring;
+}
+
+void log_enqueue(int level, const char* format, ...) {
+    log_ring_t* ring = log_thread_ring();
+    if (ring == NULL) {
+        return;
+    }
+    uint32_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    log_entry_t* entry = &ring->entries[head % LOG_RING_SLOTS];
+    entry->level = level;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(entry->message, sizeof(entry->message), format, args);
+    va_end(args);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Log a received payload, truncated to the configured size and sampled so large or
+// frequent packets don't flood the log.
+void log_payload(uint32_t id, int peer_fd, const char* data, size_t length) {
+    aesdsocket_log_t* log = &g_aesdsocket.log;
+    if (LOG_INFO > LOG_COMPILE_LEVEL || LOG_INFO > g_log_level || log->payload_max == 0) {
+        return;
+    }
+    log_ring_t* ring = log_thread_ring();
+    if (ring == NULL || ring->payloads_seen++ % log->sample != 0) {
+        return;
+    }
+    int shown = length > log->payload_max ? (int) log->payload_max : (int) length;
+    AESD_LOG(LOG_INFO, "   (%d) (%d): recv: (%zu): '%.*s'%s", id, peer_fd, length, shown, data,
+        (size_t) shown < length ? "..." : "");
+}
+
+// Write everything queued so far to syslog. Returns the number of messages written.
+int log_drain(aesdsocket_log_t* log) {
+    int written = 0;
+    pthread_mutex_lock(&log->drain_mutex);
+    pthread_mutex_lock(&log->registry_mutex);
+    log_ring_t* rings = log->rings;
+    pthread_mutex_unlock(&log->registry_mutex);
+
+    // Rings are never unlinked, walking the list without the lock is safe.
+    for (log_ring_t* ring = rings; ring != NULL; ring = ring->next) {
+        uint32_t tail = ring->tail;
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (; tail != head; tail++) {
+            log_entry_t* entry = &ring->entries[tail % LOG_RING_SLOTS];
+            syslog(entry->level, "%s", entry->message);
+            written += 1;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->dropped_reported) {
+            syslog(LOG_WARNING, "log ring full, dropped %ju messages", (uintmax_t) (dropped - ring->dropped_reported));
+            ring->dropped_reported = dropped;
+        }
+    }
+    pthread_mutex_unlock(&log->drain_mutex);
+    return written;
+}
+
+void* manage_log_thread(void* arg) {
+    aesdsocket_log_t* log = (aesdsocket_log_t*) arg;
+    while (true) {
+        if (log_drain(log) == 0) {
+            usleep(LOG_DRAIN_INTERVAL_US);
+        }
+    }
+    return NULL;
+}
+
+void log_init(aesdsocket_log_t* log) {
+    log->rings = NULL;
+    log->free_rings = NULL;
+    log->payload_max = DEFAULT_LOG_PAYLOAD_MAX;
+    log->sample = 1;
+    pthread_mutex_init(&log->registry_mutex, NULL);
+    pthread_mutex_init(&log->drain_mutex, NULL);
+    pthread_key_create(&log->thread_key, log_release_ring);
+}
+
+// MARK: Metrics
+
+static __thread thread_metrics_t* t_thread_metrics = NULL;
+
+uint64_t metrics_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// pthread_key destructor, hands the exiting thread's block to the next new thread.
+void metrics_release_thread(void* arg) {
+    thread_metrics_t* thread_metrics = (thread_metrics_t*) arg;
+    pthread_mutex_lock(&g_aesdsocket.metrics.registry_mutex);
+    thread_metrics->next_free = g_aesdsocket.metrics.free_threads;
+    g_aesdsocket.metrics.free_threads = thread_metrics;
+    pthread_mutex_unlock(&g_aesdsocket.metrics.registry_mutex);
+}
+
+// The calling thread's counters, registered on first use.
+thread_metrics_t* metrics_thread() {
+    if (t_thread_metrics != NULL) {
+        return t_thread_metrics;
+    }
+
+    aesdsocket_metrics_t* metrics = &g_aesdsocket.metrics;
+    pthread_mutex_lock(&metrics->registry_mutex);
+    thread_metrics_t* thread_metrics = metrics->free_threads;
+    if (thread_metrics != NULL) {
+        metrics->free_threads = thread_metrics->next_free;
+    } else {
+        thread_metrics = calloc(1, sizeof(thread_metrics_t));
+        if (thread_metrics == NULL) {
+            // Counting must never take the server down, share a static block instead.
+            static thread_metrics_t fallback_metrics;
+            thread_metrics = &fallback_metrics;
+        } else {
+            thread_metrics->next = metrics->threads;
+            metrics->threads = thread_metrics;
+        }
+    }
+    pthread_mutex_unlock(&metrics->registry_mutex);
+
+    pthread_setspecific(metrics->thread_key, thread_metrics);
+    t_thread_metrics = thread_metrics;
+    return thread_metrics;
+}
+
+void metrics_add(uint64_t* counter, uint64_t amount) {
+    __atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+}
+
+void metrics_observe(metrics_histogram_t* histogram, uint64_t duration_ns) {
+    uint64_t duration_us = duration_ns / 1000;
+    int bucket = duration_us <= 1 ? 0 : 64 - __builtin_clzll(duration_us - 1);
+    if (bucket >= METRICS_HISTOGRAM_BUCKETS) {
+        bucket = METRICS_HISTOGRAM_BUCKETS - 1;
+    }
+    metrics_add(&histogram->buckets[bucket], 1);
+    metrics_add(&histogram->sum_ns, duration_ns);
+    metrics_add(&histogram->count, 1);
+}
+
+void metrics_init(aesdsocket_metrics_t* metrics) {
+    metrics->total_connections = 0;
+    metrics->threads = NULL;
+    metrics->free_threads = NULL;
+    metrics->server_fd = -1;
+    pthread_mutex_init(&metrics->registry_mutex, NULL);
+    pthread_key_create(&metrics->thread_key, metrics_release_thread);
+}
+
+// MARK: Object pools
+
+void object_pool_init(object_pool_t* pool, size_t object_size, bool shared) {
+    pool->object_size = object_size;
+    pool->free = NULL;
+    pool->objects = 0;
+    pool->shared = shared;
+    pthread_mutex_init(&pool->mutex, NULL);
+}
+
+// Carve another slab into objects. Slabs are zeroed, so are objects the first time out.
+result_t object_pool_grow(object_pool_t* pool) {
+    char* slab = calloc(POOL_SLAB_OBJECTS, pool->object_size);
+    if (slab == NULL) {
+        perror("calloc pool slab");
         return(FAILURE);
     }
+    for (int i = POOL_SLAB_OBJECTS - 1; i >= 0; i--) {
+        void** object = (void**) (slab + i * pool->object_size);
+        *object = pool->free;
+        pool->free = object;
+    }
+    pool->objects += POOL_SLAB_OBJECTS;
+    return SUCCESS;
+}
+
+// An object of the pool, or NULL if the heap ran out.
+void* object_pool_get(object_pool_t* pool) {
+    if (pool->shared) {
+        pthread_mutex_lock(&pool->mutex);
+    }
+    void** object = NULL;
+    if (pool->free != NULL || object_pool_grow(pool) == SUCCESS) {
+        object = pool->free;
+        pool->free = *object;
+    }
+    if (pool->shared) {
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    return object;
+}
+
+void object_pool_put(object_pool_t* pool, void* object) {
+    if (pool->shared) {
+        pthread_mutex_lock(&pool->mutex);
+    }
+    *(void**) object = pool->free;
+    pool->free = object;
+    if (pool->shared) {
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+// Make sure the arena's block holds at least size bytes and start over at its beginning.
+// The block only gets reallocated when a bigger one is asked for.
+result_t arena_reset(arena_t* arena, size_t size) {
+    if (arena->base == NULL || arena->size < size) {
+        free(arena->base);
+        if (posix_memalign((void**) &arena->base, ARENA_ALIGNMENT, size) != 0) {
+            arena->base = NULL;
+            arena->size = 0;
+            perror("posix_memalign arena");
+            return(FAILURE);
+        }
+        arena->size = size;
+    }
+    arena->used = 0;
+    return SUCCESS;
+}
+
+void* arena_alloc(arena_t* arena, size_t size) {
+    size_t aligned = (size + ARENA_ALIGNMENT - 1) & ~((size_t) ARENA_ALIGNMENT - 1);
+    if (arena->size - arena->used < aligned) {
+        return NULL;
+    }
+    void* block = arena->base + arena->used;
+    arena->used += aligned;
+    return block;
+}
+
+// MARK: Connection registry
+
+void registry_init(connection_registry_t* registry) {
+    registry->slots = NULL;
+    registry->capacity = 0;
+    registry->free_head = REGISTRY_SLOT_NONE;
+    registry->live = 0;
+    registry->completed = NULL;
+}
+
+// Give the entry a slot, doubling the table when it's full. Returns its handle.
+result_t registry_add(connection_registry_t* registry, connection_entry_t* entry) {
+    if (registry->free_head == REGISTRY_SLOT_NONE) {
+        uint32_t capacity = registry->capacity == 0 ? 64 : registry->capacity * 2;
+        registry_slot_t* slots = realloc(registry->slots, capacity * sizeof(registry_slot_t));
+        if (slots == NULL) {
+            perror("realloc registry");
+            return(FAILURE);
+        }
+        // Chain the new slots up lowest first, so low slots get reused first.
+        for (uint32_t i = capacity; i > registry->capacity; i--) {
+            slots[i - 1].entry = NULL;
+            slots[i - 1].generation = 0;
+            slots[i - 1].next_free = registry->free_head;
+            registry->free_head = i - 1;
+        }
+        registry->slots = slots;
+        registry->capacity = capacity;
+    }
+    uint32_t index = registry->free_head;
+    registry_slot_t* slot = &registry->slots[index];
+    registry->free_head = slot->next_free;
+    slot->entry = entry;
+    entry->handle = (uint64_t) slot->generation << 32 | index;
+    registry->live += 1;
+    return SUCCESS;
+}
+
+// Release the handle's slot and return its entry, or NULL for a stale handle.
+connection_entry_t* registry_remove(connection_registry_t* registry, uint64_t handle) {
+    uint32_t index = (uint32_t) handle;
+    if (index >= registry->capacity || registry->slots[index].generation != (uint32_t) (handle >> 32)) {
+        return NULL;
+    }
+    registry_slot_t* slot = &registry->slots[index];
+    connection_entry_t* entry = slot->entry;
+    slot->entry = NULL;
+    slot->generation += 1;
+    slot->next_free = registry->free_head;
+    registry->free_head = index;
+    registry->live -= 1;
+    return entry;
+}
+
+// Called by a connection thread as the last thing it does.
+void registry_complete(connection_registry_t* registry, connection_entry_t* entry) {
+    connection_entry_t* head = __atomic_load_n(&registry->completed, __ATOMIC_RELAXED);
+    do {
+        entry->next_completed = head;
+    } while (!__atomic_compare_exchange_n(&registry->completed, &head, entry, true,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Taking the whole stack at once leaves no room for ABA.
+connection_entry_t* registry_take_completed(connection_registry_t* registry) {
+    return __atomic_exchange_n(&registry->completed, NULL, __ATOMIC_ACQUIRE);
+}
+
+// MARK: Business Logic Start
 
-    *server_fd = socket((*address)->ai_family, (*address)->ai_socktype, (*address)->ai_protocol);
+// Create a socket listening on address. With reuseport every event loop opens one of
+// these on the same port and the kernel spreads new connections across them.
+result_t open_listener(const addrinfo_t* address, const aesdsocket_config_t* config, int* server_fd) {
+    *server_fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (*server_fd == -1) {
+        perror("socket");
+        return(FAILURE);
+    }
 
     // Allow re-using the port, if you restart this program in quick succession without this
     // you'll hint errors around the port still being use. It takes linux a minute or so to
@@ -156,13 +1087,43 @@ result_t start_listen_server(int* server_fd, struct addrinfo** address, socklen_
         perror("setsockopt");
         return(FAILURE);
     }
+    if (config->reuseport
+            && setsockopt(*server_fd, SOL_SOCKET, SO_REUSEPORT, &enabled, sizeof(enabled)) == -1) {
+        perror("setsockopt SO_REUSEPORT");
+        return(FAILURE);
+    }
+    // Only wake an acceptor once the client sent something, not on the bare handshake.
+    if (config->defer_accept > 0 && setsockopt(*server_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+            &config->defer_accept, sizeof(config->defer_accept)) == -1) {
+        perror("setsockopt TCP_DEFER_ACCEPT");
+        return(FAILURE);
+    }
+    // Keep-alive echoes go out in several sends on a connection that stays open, Nagle
+    // would hold back their tail until the peer's delayed ACK. Accepted sockets inherit it,
+    // and the buffer sizes. The receive buffer has to be set before listen() so the window
+    // scale matches it.
+    int nodelay = config->nodelay == -1 ? config->keep_alive : config->nodelay;
+    if (nodelay && setsockopt(*server_fd, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled)) == -1) {
+        perror("setsockopt TCP_NODELAY");
+        return(FAILURE);
+    }
+    if (config->socket_send_buffer > 0 && setsockopt(*server_fd, SOL_SOCKET, SO_SNDBUF,
+            &config->socket_send_buffer, sizeof(config->socket_send_buffer)) == -1) {
+        perror("setsockopt SO_SNDBUF");
+        return(FAILURE);
+    }
+    if (config->socket_receive_buffer > 0 && setsockopt(*server_fd, SOL_SOCKET, SO_RCVBUF,
+            &config->socket_receive_buffer, sizeof(config->socket_receive_buffer)) == -1) {
+        perror("setsockopt SO_RCVBUF");
+        return(FAILURE);
+    }
 
-    if (bind(*server_fd, (*address)->ai_addr, (*address)->ai_addrlen) < 0) {
+    if (bind(*server_fd, address->ai_addr, address->ai_addrlen) < 0) {
         perror("bind failed");
         return(FAILURE);
     }
 
-    if (listen(*server_fd, 32) < 0) {
+    if (listen(*server_fd, config->listen_backlog) < 0) {
         perror("listen failed");
         return(FAILURE);
     }
@@ -170,61 +1131,87 @@ result_t start_listen_server(int* server_fd, struct addrinfo** address, socklen_
     return SUCCESS;
 }
 
+result_t start_listen_server(int* server_fd, struct addrinfo** address, const aesdsocket_config_t* config) {
+    addrinfo_t address_hints;
+
+    memset(&address_hints, 0, sizeof(address_hints));
+    address_hints.ai_family = AF_UNSPEC;
+    address_hints.ai_socktype = SOCK_STREAM;
+    address_hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(NULL, "9000", &address_hints, address) != 0) {
+        perror("getaddrinfo");
+        return(FAILURE);
+    }
+
+    return open_listener(*address, config, server_fd);
+}
+
 void init_aesdsocket(aesdsocket_t* aesdsocket) {
+    aesdsocket->history.data_fd = -1;
+    aesdsocket->history.index_fd = -1;
+    aesdsocket->event_loops = NULL;
+    aesdsocket->uring_loops = NULL;
     aesdsocket->connections_count = 0;
-    aesdsocket->metrics.total_connections = 0;
-    SLIST_INIT(&aesdsocket->connections);
-    pthread_mutex_init(&aesdsocket->connections_mutex, NULL);
-    pthread_mutex_init(&aesdsocket->file_mutex, NULL);
+    aesdsocket->signal_fd = -1;
+    aesdsocket->shutdown_fd = -1;
+    aesdsocket->shutting_down = false;
+    metrics_init(&aesdsocket->metrics);
+    log_init(&aesdsocket->log);
+    object_pool_init(&aesdsocket->entry_pool, sizeof(connection_entry_t), true);
+    registry_init(&aesdsocket->registry);
 }
 
 void deinit_aesdsocket(aesdsocket_t* aesdsocket) {
-    pthread_mutex_destroy(&aesdsocket->connections_mutex);
-    pthread_mutex_destroy(&aesdsocket->file_mutex);
+    free(aesdsocket->registry.slots);
 }
 
 
 // MARK: Cleanup
 
+// Runs once, either from main after the server drained or from the signal thread when
+// the drain deadline passes. Connections still open at that point are cut off by exit().
 static void cleanup_and_exit(aesdsocket_t* aesdsocket) {
+    static pthread_mutex_t cleanup_mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&cleanup_mutex);  // never unlocked, a second caller waits for exit()
     syslog(LOG_DEBUG, "cleanup_and_exit()");
 
-    // Join up the timestamp thread
-    pthread_cancel(aesdsocket->timestamp_thread);
-    int join_result = pthread_join(aesdsocket->timestamp_thread, NULL);
-    if (join_result != 0) {
-        perror("pthread_join");
-    }
-
-    // Remove all connections
-    pthread_mutex_lock(&aesdsocket->connections_mutex);
-    struct connection_entry_s *entry = NULL;
-    struct connection_entry_s *temp = NULL;
-    SLIST_FOREACH_SAFE(entry, &aesdsocket->connections, entries, temp) {
-        if (entry->done) {
-            if (pthread_cancel(entry->thread_id) != 0) {
-                perror("pthread_cancel");
-            }
+    // Stop the timestamps and join up the housekeeping thread
+    housekeeping_stop(&aesdsocket->housekeeping);
 
-            int join_result = pthread_join(entry->thread_id, NULL);
-            if (join_result != 0) {
-                perror("pthread_join");
-            }
-            SLIST_REMOVE(&aesdsocket->connections, entry, connection_entry_s, entries);
-            aesdsocket->connections_count -= 1;
-            syslog(LOG_DEBUG, "removed connection. connections_count: %d", aesdsocket->connections_count);
-        }
-    }
-    syslog(LOG_INFO, "post cleanup connections: %d", aesdsocket->connections_count);
-    pthread_mutex_unlock(&aesdsocket->connections_mutex);
+    history_flush(&aesdsocket->history, HISTORY_FLUSH_TIMEOUT_MS);
+    log_drain(&aesdsocket->log);
+    syslog(LOG_INFO, "post cleanup connections: %d",
+        __atomic_load_n(&aesdsocket->connections_count, __ATOMIC_RELAXED));
 
     // Clean up file data
-    if (access("/var/tmp/aesdsocketdata", F_OK) == 0) {
-        if (remove("/var/tmp/aesdsocketdata") != 0) {
+    if (aesdsocket->history.data_fd != -1) {
+        close(aesdsocket->history.data_fd);
+        aesdsocket->history.data_fd = -1;
+    }
+    if (aesdsocket->history.index_fd != -1) {
+        close(aesdsocket->history.index_fd);
+        aesdsocket->history.index_fd = -1;
+    }
+    if (access(DATA_FILE_PATH, F_OK) == 0) {
+        if (remove(DATA_FILE_PATH) != 0) {
             perror("remove failed");
             exit(-1);
         }
     }
+    if (aesdsocket->history.segment_size != 0) {
+        history_files_remove(&aesdsocket->history);
+    }
+    // The index is only valid alongside the data file it was built from.
+    if (access(INDEX_FILE_PATH, F_OK) == 0 && remove(INDEX_FILE_PATH) != 0) {
+        perror("remove index failed");
+    }
+
+    if (aesdsocket->metrics.server_fd != -1) {
+        close(aesdsocket->metrics.server_fd);
+        if (aesdsocket->config.metrics_socket != NULL) {
+            unlink(aesdsocket->config.metrics_socket);
+        }
+    }
 
     if (aesdsocket->server_fd != 0) {
         if (shutdown(aesdsocket->server_fd, SHUT_RDWR) != 0) {
@@ -246,227 +1233,4547 @@ static void cleanup_and_exit(aesdsocket_t* aesdsocket) {
     exit(0);
 }
 
-void join_completed_threads(aesdsocket_t* aesdsocket) {
-    syslog(LOG_DEBUG, "join_completed_threads()");
-    pthread_mutex_lock(&aesdsocket->connections_mutex);
-    struct connection_entry_s *entry = NULL;
-    struct connection_entry_s *temp = NULL;
-    SLIST_FOREACH_SAFE(entry, &aesdsocket->connections, entries, temp) {
-        if (entry->done) {
-            pthread_join(entry->thread_id, NULL);
-            SLIST_REMOVE(&aesdsocket->connections, entry, connection_entry_s, entries);
-            aesdsocket->connections_count -= 1;
-            syslog(LOG_DEBUG, "removed connection. connections_count: %d", aesdsocket->connections_count);
-        }
+// MARK: Shutdown
+
+// Stop accepting and let every mode drain the connections it already has. Acceptors and
+// event loops notice through shutdown_fd, which stays readable from here on.
+void request_shutdown(aesdsocket_t* aesdsocket) {
+    __atomic_store_n(&aesdsocket->shutting_down, true, __ATOMIC_SEQ_CST);
+    uint64_t one = 1;
+    if (write(aesdsocket->shutdown_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("write shutdown_fd");
     }
-    pthread_mutex_unlock(&aesdsocket->connections_mutex);
 }
 
-// MARK: Timestamp thread
-
-static void timestamp_timer_handler(union sigval sv) {
-    time_t now_raw;
-    struct tm* now;
-    char buffer[256];
-    time(&now_raw);
-    now = localtime(&now_raw);
-    strftime(buffer, sizeof(buffer), "timestamp:%a, %d %b %Y %T %z\n", now);
-    syslog(LOG_DEBUG, "%s", buffer);
+bool shutdown_requested(aesdsocket_t* aesdsocket) {
+    return __atomic_load_n(&aesdsocket->shutting_down, __ATOMIC_ACQUIRE);
+}
 
-    syslog(LOG_DEBUG, "connections: %d", g_aesdsocket.connections_count);
-    FILE* fp = fopen("/var/tmp/aesdsocketdata", "a+");
-    if (fp == NULL) {
-        perror("fopen failed");
+// The first SIGINT/SIGTERM starts a graceful shutdown, main exits once the server has
+// drained. A second signal or the drain deadline passing exits right away.
+void* manage_signal_thread(void* arg) {
+    aesdsocket_t* aesdsocket = (aesdsocket_t*) arg;
+    struct signalfd_siginfo info;
+    if (read(aesdsocket->signal_fd, &info, sizeof(info)) != sizeof(info)) {
+        perror("read signal_fd");
+        cleanup_and_exit(aesdsocket);
     }
+    syslog(LOG_INFO, "Caught signal, exiting");
+    syslog(LOG_DEBUG, "%s (%u), draining connections", strsignal(info.ssi_signo), info.ssi_signo);
+    request_shutdown(aesdsocket);
 
-    pthread_mutex_lock(&g_aesdsocket.file_mutex);
-    int fputs_result = fputs(buffer, fp);
-    pthread_mutex_unlock(&g_aesdsocket.file_mutex);
-
-    if (fputs_result == EOF) {
-        perror("fputs failed");
+    struct pollfd signal_poll = { .fd = aesdsocket->signal_fd, .events = POLLIN };
+    if (poll(&signal_poll, 1, aesdsocket->config.drain_timeout * 1000) > 0) {
+        syslog(LOG_WARNING, "Caught second signal, exiting with %d connections open",
+            __atomic_load_n(&aesdsocket->connections_count, __ATOMIC_RELAXED));
+    } else {
+        syslog(LOG_WARNING, "drain timed out after %d s, exiting with %d connections open",
+            aesdsocket->config.drain_timeout, __atomic_load_n(&aesdsocket->connections_count, __ATOMIC_RELAXED));
     }
+    cleanup_and_exit(aesdsocket);
+    return NULL;
+}
 
-    if (fclose(fp) != 0) {
-        perror("fclose failed");
+// Called by each acceptor once it took what was left in the backlog. The last one closes
+// the listening socket so new clients are refused instead of waiting in the backlog.
+void stop_accepting(aesdsocket_t* aesdsocket) {
+    if (__atomic_sub_fetch(&aesdsocket->acceptors, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(aesdsocket->server_fd);
+        aesdsocket->server_fd = 0;
+        syslog(LOG_INFO, "stopped listening");
     }
 }
 
-static timer_t timerid;
-
-void* manage_timestamp_thread(void* arg) {
-    struct sigevent sev = { 0 };
-    sev.sigev_notify = SIGEV_THREAD;
-    sev.sigev_notify_function = timestamp_timer_handler;
-    sev.sigev_notify_attributes = NULL;
+// accept() for the thread and pool acceptors that also gives up once shutdown is
+// requested. The listening socket is non-blocking, so while the backlog is busy this is
+// a plain accept() and the poll() only happens when there is nothing to take. Whatever
+// already sits in the backlog at shutdown is still accepted. Returns -1 with errno set
+// to ECANCELED on shutdown.
+int accept_until_shutdown(aesdsocket_t* aesdsocket) {
+    while (true) {
+        int peer_fd = accept(aesdsocket->server_fd, NULL, NULL);
+        if (peer_fd != -1 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            return peer_fd;
+        }
+        if (shutdown_requested(aesdsocket)) {
+            errno = ECANCELED;
+            return -1;
+        }
 
-    if (timer_create(CLOCK_REALTIME, &sev, &timerid) == -1) {
-        perror("timer_create");
+        struct pollfd polls[2] = {
+            { .fd = aesdsocket->server_fd, .events = POLLIN },
+            { .fd = aesdsocket->shutdown_fd, .events = POLLIN },
+        };
+        if (poll(polls, 2, -1) == -1 && errno != EINTR) {
+            return -1;
+        }
     }
+}
 
-    struct itimerspec its = { 0 };
-    its.it_interval.tv_sec = 10;
-    its.it_value.tv_sec = 10;
-
-    if (timer_settime(timerid, 0, &its, NULL) == -1) {
-        perror("timer_settime");
-    }
+// MARK: History
 
-    while(true) {
-        sleep(1);
+result_t pwrite_all(int fd, const char* buffer, size_t length, off_t offset) {
+    while (length > 0) {
+        ssize_t written = pwrite(fd, buffer, length, offset);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("pwrite failed");
+            return(FAILURE);
+        }
+        buffer += written;
+        length -= written;
+        offset += written;
     }
+    return SUCCESS;
 }
 
-// MARK: Connection threads
-
-int handle_peer(uint32_t id, int peer_fd, pthread_mutex_t file_mutex) {
-    sockaddr_in_t peer_address;
-    socklen_t peer_address_length = 0;
-    pthread_t thread_id = pthread_self();
-
+// Writes the whole vector, adjusting iov in place after partial writes.
+result_t pwritev_all(int fd, struct iovec* iov, int count, off_t offset) {
+    while (count > 0) {
+        ssize_t written = pwritev(fd, iov, count, offset);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("pwritev failed");
+            return(FAILURE);
+        }
+        offset += written;
+        while (count > 0 && (size_t) written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return SUCCESS;
+}
+
+result_t write_all(int fd, const char* buffer, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, buffer, length);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write failed");
+            return(FAILURE);
+        }
+        buffer += written;
+        length -= written;
+    }
+    return SUCCESS;
+}
+
+// MARK: History tables
+
+result_t history_table_append(history_table_t* table, uint64_t value) {
+    size_t block = table->count / HISTORY_TABLE_BLOCK_SIZE;
+    if (block - table->first / HISTORY_TABLE_BLOCK_SIZE >= HISTORY_TABLE_BLOCKS) {
+        return(FAILURE);
+    }
+    if (table->count % HISTORY_TABLE_BLOCK_SIZE == 0) {
+        uint64_t* entries = table->spare;
+        if (entries != NULL) {
+            table->spare = (uint64_t*) (uintptr_t) entries[0];
+        } else {
+            entries = malloc(HISTORY_TABLE_BLOCK_SIZE * sizeof(uint64_t));
+            if (entries == NULL) {
+                perror("malloc history table block");
+                return(FAILURE);
+            }
+        }
+        __atomic_store_n(&table->blocks[block % HISTORY_TABLE_BLOCKS], entries, __ATOMIC_RELEASE);
+    }
+    table->blocks[block % HISTORY_TABLE_BLOCKS][table->count % HISTORY_TABLE_BLOCK_SIZE] = value;
+    __atomic_store_n(&table->count, table->count + 1, __ATOMIC_RELEASE);
+    return SUCCESS;
+}
+
+size_t history_table_count(const history_table_t* table) {
+    return __atomic_load_n(&table->count, __ATOMIC_ACQUIRE);
+}
+
+size_t history_table_first(const history_table_t* table) {
+    return __atomic_load_n(&table->first, __ATOMIC_SEQ_CST);
+}
+
+const uint64_t* history_table_entry(const history_table_t* table, size_t index) {
+    size_t block = index / HISTORY_TABLE_BLOCK_SIZE % HISTORY_TABLE_BLOCKS;
+    return &__atomic_load_n(&table->blocks[block], __ATOMIC_ACQUIRE)[index % HISTORY_TABLE_BLOCK_SIZE];
+}
+
+uint64_t history_table_get(const history_table_t* table, size_t index) {
+    return *history_table_entry(table, index);
+}
+
+// Whether index may have been trimmed and recycled since it was read, for lock free
+// readers to call after the read.
+bool history_table_trimmed(const history_table_t* table, size_t index) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return index < history_table_first(table);
+}
+
+// Recycle the blocks wholly below index. Same serialization as appends.
+void history_table_trim(history_table_t* table, size_t index) {
+    size_t first = index - index % HISTORY_TABLE_BLOCK_SIZE;
+    if (first <= table->first) {
+        return;
+    }
+    size_t block = table->first / HISTORY_TABLE_BLOCK_SIZE;
+    // Readers have to see the new first before any of these blocks is written again.
+    __atomic_store_n(&table->first, first, __ATOMIC_SEQ_CST);
+    for (; block < first / HISTORY_TABLE_BLOCK_SIZE; block++) {
+        uint64_t* entries = table->blocks[block % HISTORY_TABLE_BLOCKS];
+        entries[0] = (uintptr_t) table->spare;
+        table->spare = entries;
+    }
+}
+
+// Only for startup, before any reader.
+void history_table_clear(history_table_t* table) {
+    for (size_t block = 0; block < HISTORY_TABLE_BLOCKS; block++) {
+        free(table->blocks[block]);
+    }
+    memset(table, 0, sizeof(*table));
+}
+
+
+// MARK: Segment files
+
+void segment_file_path(char* path, size_t segment) {
+    snprintf(path, SEGMENT_FILE_PATH_MAX, SEGMENT_FILE_FORMAT, segment);
+}
+
+history_file_t* history_file_open(size_t segment, int flags) {
+    char path[SEGMENT_FILE_PATH_MAX];
+    segment_file_path(path, segment);
+    history_file_t* file = malloc(sizeof(history_file_t));
+    if (file == NULL) {
+        perror("malloc history file");
+        return NULL;
+    }
+    file->fd = open(path, flags, 0644);
+    if (file->fd == -1) {
+        perror("open segment file failed");
+        free(file);
+        return NULL;
+    }
+    file->refs = 0;
+    file->map = NULL;
+    return file;
+}
+
+history_file_t* history_file_get(history_t* history, size_t offset) {
+    return (history_file_t*) (uintptr_t) history_table_get(&history->files, offset / history->segment_size);
+}
+
+// Close a dropped file that nobody holds anymore, exactly once.
+void history_file_try_close(history_t* history, history_file_t* file) {
+    uint64_t expected = HISTORY_FILE_DROPPED;
+    if (__atomic_compare_exchange_n(&file->refs, &expected, HISTORY_FILE_DROPPED | HISTORY_FILE_CLOSED,
+            false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        if (file->map != NULL) {
+            munmap(file->map, history->segment_size);
+            file->map = NULL;
+        }
+        close(file->fd);
+        file->fd = -1;
+    }
+}
+
+void history_file_release(history_t* history, history_file_t* file) {
+    if (__atomic_sub_fetch(&file->refs, 1, __ATOMIC_ACQ_REL) == HISTORY_FILE_DROPPED) {
+        history_file_try_close(history, file);
+    }
+}
+
+// Take a reference on the segment file holding offset, or NULL if retention dropped it.
+history_file_t* history_file_acquire(history_t* history, size_t offset) {
+    history_file_t* file = history_file_get(history, offset);
+    if (file == NULL) {
+        return NULL;
+    }
+    if (__atomic_fetch_add(&file->refs, 1, __ATOMIC_ACQ_REL) & HISTORY_FILE_DROPPED) {
+        history_file_release(history, file);
+        return NULL;
+    }
+    return file;
+}
+
+// Make sure the segment files up to the one holding last_offset exist. Appends reserve
+// out of order, a later segment can be asked for before an earlier one.
+result_t history_files_reserve(history_t* history, size_t last_offset) {
+    size_t segment = last_offset / history->segment_size;
+    if (history_table_count(&history->files) > segment) {
+        return SUCCESS;
+    }
+
+    result_t result = SUCCESS;
+    pthread_mutex_lock(&history->mutex);
+    while (history->files.count <= segment) {
+        history_file_t* file = history_file_open(history->files.count, O_RDWR | O_CREAT | O_TRUNC);
+        if (file == NULL || history_table_append(&history->files, (uintptr_t) file) == FAILURE) {
+            result = FAILURE;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&history->mutex);
+    return result;
+}
+
+// Write length bytes of iov at offset, split at segment boundaries. Adjusts iov in place.
+result_t history_files_writev(history_t* history, struct iovec* iov, int count, size_t offset, size_t length) {
+    if (history_files_reserve(history, offset + length - 1) == FAILURE) {
+        return(FAILURE);
+    }
+    while (length > 0) {
+        history_file_t* file = history_file_get(history, offset);
+        size_t file_offset = offset % history->segment_size;
+        size_t span = history->segment_size - file_offset;
+        if (span > length) {
+            span = length;
+        }
+
+        // Cut iov at the segment boundary, the entry crossing it continues in the next one.
+        int span_count = 0;
+        size_t covered = 0;
+        while (covered < span) {
+            covered += iov[span_count++].iov_len;
+        }
+        struct iovec crossing = iov[span_count - 1];
+        size_t excess = covered - span;
+        iov[span_count - 1].iov_len -= excess;
+        if (pwritev_all(file->fd, iov, span_count, file_offset) == FAILURE) {
+            return(FAILURE);
+        }
+        iov += span_count - 1;
+        count -= span_count - 1;
+        iov[0].iov_base = (char*) crossing.iov_base + crossing.iov_len - excess;
+        iov[0].iov_len = excess;
+        if (excess == 0) {
+            iov++;
+            count--;
+        }
+        offset += span;
+        length -= span;
+    }
+    return SUCCESS;
+}
+
+// Map a whole segment file the first time a reader gets to it, the reader's reference
+// keeps it from being unmapped under it.
+const char* history_map_file(history_t* history, history_file_t* file) {
+    char* map = __atomic_load_n(&file->map, __ATOMIC_ACQUIRE);
+    if (map != NULL) {
+        return map;
+    }
+
+    pthread_mutex_lock(&history->maps_mutex);
+    map = file->map;
+    if (map == NULL) {
+        map = mmap(NULL, history->segment_size, PROT_READ, MAP_SHARED, file->fd, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap segment file");
+            map = NULL;
+        } else {
+            if (madvise(map, history->segment_size, MADV_SEQUENTIAL) != 0) {
+                perror("madvise");
+            }
+            __atomic_store_n(&file->map, map, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&history->maps_mutex);
+    return map;
+}
+
+// Only for startup, before anything can be dropped.
+ssize_t history_pread(history_t* history, char* buffer, size_t length, size_t offset) {
+    if (history->segment_size == 0) {
+        return pread(history->data_fd, buffer, length, offset);
+    }
+    size_t file_offset = offset % history->segment_size;
+    if (length > history->segment_size - file_offset) {
+        length = history->segment_size - file_offset;
+    }
+    return pread(history_file_get(history, offset)->fd, buffer, length, file_offset);
+}
+
+// Pick up the segment files a previous run left behind. Their numbers have to be
+// consecutive and all but the last one full.
+result_t history_files_recover(history_t* history) {
+    DIR* dir = opendir(DATA_FILE_DIR);
+    if (dir == NULL) {
+        perror("opendir data file dir");
+        return(FAILURE);
+    }
+    size_t first = SIZE_MAX;
+    size_t last = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t segment;
+        char trailing;
+        if (sscanf(entry->d_name, DATA_FILE_NAME ".%zu%c", &segment, &trailing) == 1) {
+            first = segment < first ? segment : first;
+            last = segment > last ? segment : last;
+        }
+    }
+    closedir(dir);
+    if (first == SIZE_MAX) {
+        return SUCCESS;
+    }
+
+    for (size_t segment = 0; segment <= last; segment++) {
+        history_file_t* file = NULL;
+        if (segment >= first) {
+            file = history_file_open(segment, O_RDWR);
+            struct stat file_stat;
+            if (file == NULL || fstat(file->fd, &file_stat) != 0) {
+                return(FAILURE);
+            }
+            size_t size = file_stat.st_size;
+            if (size > history->segment_size || (segment < last && size != history->segment_size)) {
+                syslog(LOG_ERR, "segment file %zu is %zu bytes, segment size is %zu",
+                    segment, size, history->segment_size);
+                fprintf(stderr, "segment file %zu doesn't match the segment size\n", segment);
+                return(FAILURE);
+            }
+            history->length = segment * history->segment_size + size;
+        }
+        if (history_table_append(&history->files, (uintptr_t) file) == FAILURE) {
+            return(FAILURE);
+        }
+    }
+    history->reserved = history->length;
+    history->dropped_segments = first;
+    history->start = first * history->segment_size;
+    syslog(LOG_INFO, "recovered segment files %zu to %zu", first, last);
+    return SUCCESS;
+}
+
+// Runs in the publish turn, so only one thread at a time moves start. Moves it up to
+// the oldest record within the caps, then drops the segment files and record index
+// blocks wholly below it. Readers see the new start before any file goes away.
+void history_retain(history_t* history, size_t length) {
+    size_t records = history->records.count;
+    size_t start = history->start;
+    size_t start_record = history->start_record;
+    while (start_record < records
+            && ((history->retain_records != 0 && records - start_record > history->retain_records)
+                || (history->retain_bytes != 0 && length - start > history->retain_bytes))) {
+        start = history_table_get(&history->records, start_record);
+        start_record++;
+    }
+    if (start == history->start) {
+        return;
+    }
+    __atomic_store_n(&history->start_record, start_record, __ATOMIC_RELEASE);
+    __atomic_store_n(&history->start, start, __ATOMIC_SEQ_CST);
+    // The index keeps the end of the last dropped record, where the first retained one
+    // begins. No sidecar to write from it, that only comes with a single data file.
+    history_table_trim(&history->records, start_record - 1);
+
+    while ((history->dropped_segments + 1) * history->segment_size <= start) {
+        history_file_t* file = history_file_get(history, history->dropped_segments * history->segment_size);
+        if (file != NULL) {
+            char path[SEGMENT_FILE_PATH_MAX];
+            segment_file_path(path, history->dropped_segments);
+            if (unlink(path) != 0) {
+                perror("unlink segment file");
+            }
+            __atomic_fetch_or(&file->refs, HISTORY_FILE_DROPPED, __ATOMIC_ACQ_REL);
+            history_file_try_close(history, file);
+        }
+        history->dropped_segments++;
+    }
+}
+
+// Cut the stored history back to length after an append past it failed to write, so a
+// restart doesn't pick up the hole. Runs in the publish turn of every append reserved
+// before appends stopped, each one may have written past length since.
+void history_truncate(history_t* history, size_t length) {
+    if (history->segment_size == 0) {
+        if (ftruncate(history->data_fd, length) != 0) {
+            perror("ftruncate data file");
+        }
+        return;
+    }
+    size_t segment = length / history->segment_size;
+    for (size_t later = segment; later < history_table_count(&history->files); later++) {
+        history_file_t* file = history_file_get(history, later * history->segment_size);
+        if (later == segment) {
+            if (ftruncate(file->fd, length % history->segment_size) != 0) {
+                perror("ftruncate segment file");
+            }
+            continue;
+        }
+        char path[SEGMENT_FILE_PATH_MAX];
+        segment_file_path(path, later);
+        if (unlink(path) != 0 && errno != ENOENT) {
+            perror("unlink segment file");
+        }
+    }
+}
+
+void history_files_remove(history_t* history) {
+    for (size_t segment = history->dropped_segments; segment < history->files.count; segment++) {
+        char path[SEGMENT_FILE_PATH_MAX];
+        segment_file_path(path, segment);
+        if (unlink(path) != 0 && errno != ENOENT) {
+            perror("unlink segment file");
+        }
+    }
+}
+
+
+// MARK: Newline scanning
+
+// Bit i of the mask is set when data[i] is a newline, for the NEWLINE_BLOCK bytes at data.
+// One compare per vector and no branch per newline, dense short records cost the same as
+// sparse ones.
+typedef uint64_t (*newline_block_t)(const char* data);
+
+uint64_t newline_block_scalar(const char* data) {
+    uint64_t mask = 0;
+    for (int i = 0; i < NEWLINE_BLOCK; i++) {
+        mask |= (uint64_t) (data[i] == '\n') << i;
+    }
+    return mask;
+}
+
+#if defined(__x86_64__)
+// Loaded rather than built with _mm_set1_epi8(), which doesn't fold without optimization.
+static const char g_newlines[32] __attribute__((aligned(32))) = {
+    '\n', '\n', '\n', '\n', '\n', '\n', '\n', '\n', '\n', '\n', '\n', '\n', '\n', '\n', '\n', '\n',
+    '\n', '\n', '\n', '\n', '\n', '\n', '\n', '\n', '\n', '\n', '\n', '\n', '\n', '\n', '\n', '\n',
+};
+
+uint64_t newline_block_sse2(const char* data) {
+    const __m128i newline = _mm_load_si128((const __m128i*) g_newlines);
+    uint64_t mask0 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) data), newline));
+    uint64_t mask1 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (data + 16)), newline));
+    uint64_t mask2 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (data + 32)), newline));
+    uint64_t mask3 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (data + 48)), newline));
+    return mask0 | mask1 << 16 | mask2 << 32 | mask3 << 48;
+}
+
+__attribute__((target("avx2")))
+uint64_t newline_block_avx2(const char* data) {
+    const __m256i newline = _mm256_load_si256((const __m256i*) g_newlines);
+    uint64_t low = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) data), newline));
+    uint64_t high = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (data + 32)), newline));
+    return low | high << 32;
+}
+#endif
+
+static newline_block_t g_newline_block = newline_block_scalar;
+
+// Pick the widest scan the CPU has. SSE2 is part of x86-64, AVX2 is checked at runtime so
+// the build doesn't need -mavx2.
+void newline_scan_init() {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    g_newline_block = __builtin_cpu_supports("avx2") ? newline_block_avx2 : newline_block_sse2;
+#endif
+}
+
+size_t count_newlines(const char* data, size_t length) {
+    size_t count = 0;
+    size_t offset = 0;
+    for (; offset + NEWLINE_BLOCK <= length; offset += NEWLINE_BLOCK) {
+        count += __builtin_popcountll(g_newline_block(data + offset));
+    }
+    for (; offset < length; offset++) {
+        count += data[offset] == '\n';
+    }
+    return count;
+}
+
+// MARK: Record index
+
+// Add a record for every newline in data, which starts at offset in the history. Appends
+// call this in history order while they hold their publish turn. The tail shorter than a
+// block is copied out so it goes through the same scan.
+void history_index_records(history_t* history, size_t offset, const char* data, size_t length) {
+    size_t scanned = 0;
+    while (scanned < length && !history->index_full) {
+        uint64_t mask;
+        if (length - scanned >= NEWLINE_BLOCK) {
+            mask = g_newline_block(data + scanned);
+        } else {
+            char tail[NEWLINE_BLOCK] = { 0 };
+            memcpy(tail, data + scanned, length - scanned);
+            mask = g_newline_block(tail);
+        }
+        if (mask == 0) {
+            // Long records, memchr() gets to the next newline quicker than block after block.
+            const char* newline = length - scanned > NEWLINE_BLOCK
+                ? memchr(data + scanned + NEWLINE_BLOCK, '\n', length - scanned - NEWLINE_BLOCK) : NULL;
+            if (newline == NULL) {
+                break;
+            }
+            scanned = newline - data;
+            continue;
+        }
+        for (; mask != 0; mask &= mask - 1) {
+            size_t end = offset + scanned + __builtin_ctzll(mask) + 1;
+            if (history_table_append(&history->records, end) == FAILURE) {
+                history->index_full = true;
+                AESD_LOG(LOG_WARNING, "record index full at %zu records, later records can't be seeked to",
+                    history->records.count);
+                break;
+            }
+        }
+        scanned += NEWLINE_BLOCK;
+    }
+}
+
+// Index the data file from offset up to the history length.
+result_t history_index_scan(history_t* history, size_t offset) {
+    char buffer[RECEIVE_BUFFER_SIZE];
+    while (offset < history->length) {
+        size_t span = history->length - offset < sizeof(buffer) ? history->length - offset : sizeof(buffer);
+        ssize_t read_amount = history_pread(history, buffer, span, offset);
+        if (read_amount <= 0) {
+            perror("pread data file");
+            return(FAILURE);
+        }
+        history_index_records(history, offset, buffer, read_amount);
+        offset += read_amount;
+    }
+    return SUCCESS;
+}
+
+// Build the index over what a previous run left in the data file. With a sidecar, its
+// entries are trusted as long as they increase, fit in the data file and the last one
+// ends in a newline, and only the data after them is scanned.
+result_t history_index_load(history_t* history) {
+    size_t scan_from = history->start;
+    if (history->persist_index) {
+        history->index_fd = open(INDEX_FILE_PATH, O_RDWR | O_CREAT, 0644);
+        if (history->index_fd == -1) {
+            perror("open index file failed");
+            return(FAILURE);
+        }
+        uint64_t entries[1024];
+        size_t loaded = 0;
+        bool valid = true;
+        while (valid) {
+            ssize_t read_amount = pread(history->index_fd, entries, sizeof(entries), loaded * sizeof(uint64_t));
+            if (read_amount <= 0) {
+                break;
+            }
+            for (size_t i = 0; i < read_amount / sizeof(uint64_t); i++) {
+                if (entries[i] <= scan_from || entries[i] > history->length
+                        || history_table_append(&history->records, entries[i]) == FAILURE) {
+                    valid = false;
+                    break;
+                }
+                scan_from = entries[i];
+                loaded += 1;
+            }
+        }
+
+        char last = '\n';
+        if (scan_from > 0 && (pread(history->data_fd, &last, 1, scan_from - 1) != 1 || last != '\n')) {
+            AESD_LOG(LOG_WARNING, "index file doesn't match the data file, rebuilding it");
+            history_table_clear(&history->records);
+            loaded = 0;
+            scan_from = 0;
+        }
+        if (ftruncate(history->index_fd, loaded * sizeof(uint64_t)) != 0) {
+            perror("ftruncate index file");
+            return(FAILURE);
+        }
+        history->index_written = loaded;
+    }
+    if (history_index_scan(history, scan_from) == FAILURE) {
+        return(FAILURE);
+    }
+    syslog(LOG_INFO, "indexed %zu records of %zu bytes", history->records.count, history->length);
+    return SUCCESS;
+}
+
+// Write the records added since the last sync to the sidecar. Runs from the periodic
+// timer, a crash loses at most that much of the sidecar and the next start rescans it.
+void history_index_sync(history_t* history) {
+    if (history->index_fd == -1) {
+        return;
+    }
+    pthread_mutex_lock(&history->index_file_mutex);
+    size_t count = history_table_count(&history->records);
+    while (history->index_written < count) {
+        size_t first = history->index_written;
+        size_t in_block = HISTORY_TABLE_BLOCK_SIZE - first % HISTORY_TABLE_BLOCK_SIZE;
+        size_t entries = count - first < in_block ? count - first : in_block;
+        if (pwrite_all(history->index_fd, (const char*) history_table_entry(&history->records, first),
+                entries * sizeof(uint64_t), first * sizeof(uint64_t)) == FAILURE) {
+            break;
+        }
+        history->index_written += entries;
+    }
+    pthread_mutex_unlock(&history->index_file_mutex);
+}
+
+// Position cursor at offset bytes into record. Fails for records that aren't complete
+// yet or were dropped and offsets outside the record.
+result_t history_seek(history_t* history, uint64_t record, uint64_t offset, history_cursor_t* cursor) {
+    if (record >= history_table_count(&history->records)
+            || record < __atomic_load_n(&history->start_record, __ATOMIC_ACQUIRE)) {
+        return(FAILURE);
+    }
+    uint64_t start = record == 0 ? 0 : history_table_get(&history->records, record - 1);
+    uint64_t end = history_table_get(&history->records, record);
+    if (history_table_trimmed(&history->records, record == 0 ? 0 : record - 1) || offset >= end - start) {
+        return(FAILURE);
+    }
+
+    cursor->offset = start + offset;
+    if (history->store == HISTORY_STORE_MEMORY) {
+        cursor->segment = (history_segment_t*) (uintptr_t)
+            history_table_get(&history->segments, cursor->offset / HISTORY_SEGMENT_SIZE);
+        cursor->segment_offset = cursor->offset % HISTORY_SEGMENT_SIZE;
+    } else {
+        cursor->segment = NULL;
+        cursor->segment_offset = 0;
+    }
+    return SUCCESS;
+}
+
+// First record ending after offset, among the ones still in the index.
+size_t history_record_after(history_t* history, size_t offset) {
+    size_t first;
+    size_t low;
+    do {
+        first = history_table_first(&history->records);
+        low = first;
+        size_t high = history_table_count(&history->records);
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            if (history_table_get(&history->records, middle) <= offset) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+    } while (history_table_trimmed(&history->records, first));
+    return low;
+}
+
+// A connection appended length bytes of complete records, which ended up at end in the
+// history. Its records are indexed by the time the append returned.
+void pipeline_appended(history_t* history, pipeline_t* pipeline, size_t length, size_t end) {
+    pipeline->appended_end = end;
+    if (__atomic_load_n(&history->index_full, __ATOMIC_RELAXED)) {
+        // Nothing to frame by anymore, the whole append is one packet.
+        pipeline->fallback_end = end;
+        pipeline->next_record = SIZE_MAX;
+        return;
+    }
+    pipeline->next_record = history_record_after(history, end - length);
+}
+
+// End of the next packet of the last append to echo, false once they all were.
+bool pipeline_next(history_t* history, pipeline_t* pipeline, size_t* send_end) {
+    if (pipeline->fallback_end != 0) {
+        *send_end = pipeline->fallback_end;
+        pipeline->fallback_end = 0;
+        return true;
+    }
+    while (pipeline->next_record < history_table_count(&history->records)) {
+        // Retention dropped those packets a while ago, there's nothing of them left to echo.
+        size_t first = history_table_first(&history->records);
+        if (pipeline->next_record < first) {
+            pipeline->next_record = first;
+            continue;
+        }
+        size_t end = history_table_get(&history->records, pipeline->next_record);
+        if (history_table_trimmed(&history->records, pipeline->next_record)) {
+            continue;
+        }
+        if (end <= pipeline->appended_end && pipeline->whole) {
+            pipeline->next_record = SIZE_MAX;
+            *send_end = pipeline->appended_end;
+            return true;
+        } else if (end <= pipeline->appended_end) {
+            pipeline->next_record += 1;
+            *send_end = end;
+            return true;
+        }
+        break;
+    }
+    return false;
+}
+
+// MARK: Group commit
+
+// Wait for something to be published, or until due_ns (CLOCK_MONOTONIC) if it isn't 0.
+void history_persist_wait(history_t* history, uint64_t due_ns) {
+    struct timespec deadline = {
+        .tv_sec = due_ns / 1000000000ull,
+        .tv_nsec = due_ns % 1000000000ull,
+    };
+    // Appenders only take the mutex to signal when they see persist_waiting set.
+    pthread_mutex_lock(&history->mutex);
+    __atomic_store_n(&history->persist_waiting, true, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&history->length, __ATOMIC_SEQ_CST) == history->persisted) {
+        if (due_ns == 0) {
+            pthread_cond_wait(&history->persist_cond, &history->mutex);
+        } else if (pthread_cond_timedwait(&history->persist_cond, &history->mutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    __atomic_store_n(&history->persist_waiting, false, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&history->mutex);
+}
+
+// Write the memory store from persisted up to end behind, straight out of the segments
+// and HISTORY_BATCH_IOVS segment spans per pwritev().
+result_t history_persist_batch(history_t* history, history_segment_t** segment, size_t* segment_offset, size_t end) {
+    if (*segment == NULL) {
+        *segment = history->head;
+    }
+    while (history->persisted < end) {
+        struct iovec iov[HISTORY_BATCH_IOVS];
+        int count = 0;
+        size_t batch = 0;
+        while (count < HISTORY_BATCH_IOVS && history->persisted + batch < end) {
+            if (*segment_offset == HISTORY_SEGMENT_SIZE) {
+                *segment = (*segment)->next;
+                *segment_offset = 0;
+            }
+            size_t span = HISTORY_SEGMENT_SIZE - *segment_offset;
+            if (span > end - history->persisted - batch) {
+                span = end - history->persisted - batch;
+            }
+            iov[count].iov_base = (*segment)->data + *segment_offset;
+            iov[count].iov_len = span;
+            count++;
+            *segment_offset += span;
+            batch += span;
+        }
+        if (pwritev_all(history->data_fd, iov, count, history->persisted) == FAILURE) {
+            return(FAILURE);
+        }
+        metrics_add(&metrics_thread()->history_writes, 1);
+        __atomic_store_n(&history->persisted, history->persisted + batch, __ATOMIC_RELAXED);
+    }
+    return SUCCESS;
+}
+
+// fdatasync() the files holding the history from from up to to.
+result_t history_sync_range(history_t* history, size_t from, size_t to) {
+    if (history->segment_size == 0) {
+        if (fdatasync(history->data_fd) != 0) {
+            perror("fdatasync data file");
+            return(FAILURE);
+        }
+        return SUCCESS;
+    }
+    for (size_t offset = from - from % history->segment_size; offset < to; offset += history->segment_size) {
+        // Retention may have dropped it already, then there's nothing left to keep.
+        history_file_t* file = history_file_acquire(history, offset);
+        if (file == NULL) {
+            continue;
+        }
+        int result = fdatasync(file->fd);
+        history_file_release(history, file);
+        if (result != 0) {
+            perror("fdatasync segment file");
+            return(FAILURE);
+        }
+    }
+    return SUCCESS;
+}
+
+void history_set_durable(history_t* history, size_t durable, bool failed) {
+    pthread_mutex_lock(&history->mutex);
+    __atomic_store_n(&history->durable, durable, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&history->sync_failed, failed, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&history->durable_cond);
+    pthread_mutex_unlock(&history->mutex);
+    if (__atomic_load_n(&history->active_watchers, __ATOMIC_SEQ_CST) > 0) {
+        history_notify_watchers(history);
+    }
+}
+
+bool history_durable(history_t* history, size_t end) {
+    return __atomic_load_n(&history->durable, __ATOMIC_SEQ_CST) >= end;
+}
+
+// Block until the history is durable up to end. Fails once syncing stopped working.
+result_t history_wait_durable(history_t* history, size_t end) {
+    pthread_mutex_lock(&history->mutex);
+    while (history->durable < end && !history->sync_failed) {
+        pthread_cond_wait(&history->durable_cond, &history->mutex);
+    }
+    bool durable = history->durable >= end;
+    pthread_mutex_unlock(&history->mutex);
+    return durable ? SUCCESS : FAILURE;
+}
+
+// Group commit for the history. Appenders never wait on the disk, everything published
+// while the previous write or fdatasync() ran goes out together in the next batch. The
+// memory store is written behind to the data file, the file store's appends already
+// wrote themselves and only get synced. Under a sync policy echoes wait for durable.
+void* manage_persist_thread(void* arg) {
+    history_t* history = (history_t*) arg;
+    history_segment_t* segment = NULL;
+    size_t segment_offset = 0;
+    uint64_t synced_ns = metrics_now_ns();
+
+    while (true) {
+        size_t end = __atomic_load_n(&history->length, __ATOMIC_ACQUIRE);
+        uint64_t sync_due_ns = 0;
+        if (history->sync == HISTORY_SYNC_INTERVAL && history->durable < history->persisted) {
+            sync_due_ns = synced_ns + history->sync_interval_ns;
+        }
+        if (end == history->persisted && (sync_due_ns == 0 || metrics_now_ns() < sync_due_ns)) {
+            history_persist_wait(history, sync_due_ns);
+            continue;
+        }
+
+        if (history->store == HISTORY_STORE_FILE) {
+            __atomic_store_n(&history->persisted, end, __ATOMIC_RELAXED);
+        } else if (history_persist_batch(history, &segment, &segment_offset, end) == FAILURE) {
+            AESD_LOG(LOG_ERR, "history write behind failed, persistence stopped");
+            history_set_durable(history, history->durable, true);
+            return NULL;
+        }
+
+        uint64_t now_ns = metrics_now_ns();
+        if (history->sync == HISTORY_SYNC_BATCH
+                || (history->sync == HISTORY_SYNC_INTERVAL && now_ns - synced_ns >= history->sync_interval_ns)) {
+            size_t synced = history->persisted;
+            if (history_sync_range(history, history->durable, synced) == FAILURE) {
+                AESD_LOG(LOG_ERR, "history sync failed, echoes waiting for it are dropped");
+                history_set_durable(history, history->durable, true);
+                return NULL;
+            }
+            metrics_add(&metrics_thread()->history_syncs, 1);
+            synced_ns = now_ns;
+            history_set_durable(history, synced, false);
+        }
+    }
+}
+
+result_t history_init(history_t* history, const aesdsocket_config_t* config) {
+    history_store_t store = config->store;
+    history->store = store;
+    history->reserved = 0;
+    history->length = 0;
+    history->write_failed = false;
+    pthread_mutex_init(&history->publish_mutex, NULL);
+    pthread_cond_init(&history->publish_cond, NULL);
+    history->publish_waiters = 0;
+    history->read_path = config->read_path;
+    memset(history->maps, 0, sizeof(history->maps));
+    pthread_mutex_init(&history->maps_mutex, NULL);
+    history->head = NULL;
+    history->tail = NULL;
+    history->tail_used = 0;
+    history->persist = store == HISTORY_STORE_MEMORY && config->persist;
+    history->persisted = 0;
+    history->persist_waiting = false;
+    history->data_fd = -1;
+    pthread_mutex_init(&history->mutex, NULL);
+    // The persist thread's interval waits are on the same clock as metrics_now_ns().
+    pthread_condattr_t persist_cond_attr;
+    pthread_condattr_init(&persist_cond_attr);
+    pthread_condattr_setclock(&persist_cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&history->persist_cond, &persist_cond_attr);
+    pthread_condattr_destroy(&persist_cond_attr);
+    history->sync = config->sync;
+    history->sync_interval_ns = (uint64_t) config->sync_interval_ms * 1000000ull;
+    history->durable = 0;
+    history->sync_failed = false;
+    pthread_cond_init(&history->durable_cond, NULL);
+    memset(&history->segments, 0, sizeof(history->segments));
+    memset(&history->files, 0, sizeof(history->files));
+    history->segment_size = store == HISTORY_STORE_FILE ? config->segment_size : 0;
+    history->dropped_segments = 0;
+    history->retain_bytes = config->retain_bytes;
+    history->retain_records = config->retain_records;
+    history->start = 0;
+    history->start_record = 0;
+    memset(&history->records, 0, sizeof(history->records));
+    history->index_full = false;
+    history->persist_index = config->persist_index;
+    history->index_fd = -1;
+    history->index_written = 0;
+    pthread_mutex_init(&history->index_file_mutex, NULL);
+    pthread_mutex_init(&history->watchers_mutex, NULL);
+    history->watchers = NULL;
+    history->free_watchers = NULL;
+    history->active_watchers = 0;
+
+    if (store == HISTORY_STORE_FILE && history->segment_size != 0) {
+        if (history_files_recover(history) == FAILURE || history_index_load(history) == FAILURE) {
+            return(FAILURE);
+        }
+        // The oldest record may have begun in a segment that was already dropped.
+        if (history->start > 0 && history->records.count > 0) {
+            history->start = history_table_get(&history->records, 0);
+            history->start_record = 1;
+        }
+    } else if (store == HISTORY_STORE_FILE) {
+        // Keep appending to whatever a previous run left behind, as the fopen("a+") did.
+        // No O_APPEND, appends pwrite() at the offset they reserved.
+        history->data_fd = open(DATA_FILE_PATH, O_RDWR | O_CREAT, 0644);
+        if (history->data_fd == -1) {
+            perror("open data file failed");
+            return(FAILURE);
+        }
+        struct stat data_stat;
+        if (fstat(history->data_fd, &data_stat) != 0) {
+            perror("fstat failed");
+            return(FAILURE);
+        }
+        history->reserved = data_stat.st_size;
+        history->length = data_stat.st_size;
+        if (history_index_load(history) == FAILURE) {
+            return(FAILURE);
+        }
+    } else if (history->persist) {
+        // The file mirrors the memory store, which always starts empty.
+        history->data_fd = open(DATA_FILE_PATH, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (history->data_fd == -1) {
+            perror("open data file failed");
+            return(FAILURE);
+        }
+    }
+
+    // The first sync also covers whatever a previous run left in the data file.
+    history->published = history->length;
+    history->persisted = history->length;
+    if (history->persist || history->sync != HISTORY_SYNC_NONE) {
+        if (pthread_create(&history->persist_thread, NULL, manage_persist_thread, history) != 0) {
+            perror("pthread_create");
+            return(FAILURE);
+        }
+    }
+    return SUCCESS;
+}
+
+// Make sure the memory store has room for length more bytes, linking in new segments
+// as needed, and reserve them. start is set to where the reserved range begins. Must be
+// called with the mutex held.
+result_t history_reserve_segments(history_t* history, size_t length, history_cursor_t* start) {
+    size_t tail_free = history->tail == NULL ? 0 : HISTORY_SEGMENT_SIZE - history->tail_used;
+    history_segment_t* first_new = NULL;
+    history_segment_t* last_new = NULL;
+
+    // Allocate everything up front so a failed malloc leaves the history untouched.
+    for (size_t needed = tail_free; needed < length; needed += HISTORY_SEGMENT_SIZE) {
+        history_segment_t* segment = malloc(sizeof(history_segment_t));
+        if (segment == NULL) {
+            perror("malloc history segment");
+            while (first_new != NULL) {
+                history_segment_t* next = first_new->next;
+                free(first_new);
+                first_new = next;
+            }
+            return(FAILURE);
+        }
+        segment->next = NULL;
+        if (last_new == NULL) {
+            first_new = segment;
+        } else {
+            last_new->next = segment;
+        }
+        last_new = segment;
+    }
+
+    start->offset = history->reserved;
+    if (tail_free > 0) {
+        start->segment = history->tail;
+        start->segment_offset = history->tail_used;
+    } else {
+        start->segment = first_new;
+        start->segment_offset = 0;
+    }
+
+    if (first_new != NULL) {
+        if (history->tail == NULL) {
+            history->head = first_new;
+        } else {
+            history->tail->next = first_new;
+        }
+        size_t new_used = length - tail_free;
+        history->tail = last_new;
+        history->tail_used = (new_used - 1) % HISTORY_SEGMENT_SIZE + 1;
+        // The table only fills up past 2^28 segments, seeking is all that would break.
+        for (history_segment_t* segment = first_new; segment != NULL; segment = segment->next) {
+            history_table_append(&history->segments, (uintptr_t) segment);
+        }
+    } else {
+        history->tail_used += length;
+    }
+    history->reserved += length;
+    return SUCCESS;
+}
+
+// MARK: History watchers
+
+history_watcher_t* history_add_watcher(history_t* history) {
+    pthread_mutex_lock(&history->watchers_mutex);
+    history_watcher_t* watcher = history->free_watchers;
+    if (watcher != NULL) {
+        history->free_watchers = watcher->next_free;
+        pthread_mutex_unlock(&history->watchers_mutex);
+        return watcher;
+    }
+    pthread_mutex_unlock(&history->watchers_mutex);
+
+    watcher = calloc(1, sizeof(history_watcher_t));
+    if (watcher == NULL) {
+        perror("calloc history watcher");
+        return NULL;
+    }
+    watcher->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (watcher->event_fd == -1) {
+        perror("eventfd");
+        free(watcher);
+        return NULL;
+    }
+    pthread_mutex_lock(&history->watchers_mutex);
+    watcher->next = history->watchers;
+    __atomic_store_n(&history->watchers, watcher, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&history->watchers_mutex);
+    return watcher;
+}
+
+// Start or stop getting wakeups. A watcher that was just activated should consume its
+// wakeup and then check the history length, anything published after that wakes it.
+void history_watch(history_t* history, history_watcher_t* watcher, bool active) {
+    if (watcher->active == active) {
+        return;
+    }
+    __atomic_store_n(&watcher->active, active, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&history->active_watchers, active ? 1 : -1, __ATOMIC_SEQ_CST);
+}
+
+void history_remove_watcher(history_t* history, history_watcher_t* watcher) {
+    history_watch(history, watcher, false);
+    pthread_mutex_lock(&history->watchers_mutex);
+    watcher->next_free = history->free_watchers;
+    history->free_watchers = watcher;
+    pthread_mutex_unlock(&history->watchers_mutex);
+}
+
+// Consume a wakeup. Must come before reading the history length, so that a publish the
+// read misses is guaranteed to write the eventfd again.
+void history_watcher_rearm(history_watcher_t* watcher) {
+    uint64_t count;
+    if (read(watcher->event_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("read watcher event_fd");
+    }
+    __atomic_store_n(&watcher->pending, false, __ATOMIC_SEQ_CST);
+}
+
+void history_notify_watchers(history_t* history) {
+    // The list is only ever prepended to, walking it without the lock is safe.
+    history_watcher_t* watcher = __atomic_load_n(&history->watchers, __ATOMIC_ACQUIRE);
+    for (; watcher != NULL; watcher = watcher->next) {
+        if (__atomic_load_n(&watcher->active, __ATOMIC_SEQ_CST)
+                && !__atomic_exchange_n(&watcher->pending, true, __ATOMIC_SEQ_CST)) {
+            uint64_t one = 1;
+            if (write(watcher->event_fd, &one, sizeof(one)) == -1) {
+                perror("write watcher event_fd");
+            }
+        }
+    }
+}
+
+// Sleep until every append reserved before offset went through its publish turn.
+void history_wait_turn(history_t* history, size_t offset) {
+    if (__atomic_load_n(&history->published, __ATOMIC_ACQUIRE) == offset) {
+        return;
+    }
+    pthread_mutex_lock(&history->publish_mutex);
+    __atomic_add_fetch(&history->publish_waiters, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&history->published, __ATOMIC_SEQ_CST) != offset) {
+        pthread_cond_wait(&history->publish_cond, &history->publish_mutex);
+    }
+    __atomic_sub_fetch(&history->publish_waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&history->publish_mutex);
+}
+
+// Hand the turn on to the append reserved at end, waking it if it's waiting.
+void history_pass_turn(history_t* history, size_t end) {
+    __atomic_store_n(&history->published, end, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&history->publish_waiters, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&history->publish_mutex);
+        pthread_cond_broadcast(&history->publish_cond);
+        pthread_mutex_unlock(&history->publish_mutex);
+    }
+}
+
+// Appends finish out of order, but readers may only ever see a prefix in which every
+// byte is written. Wait for the appends reserved before this one to publish first,
+// they are only a memcpy or pwrite away. Holding the turn also keeps the record index
+// in history order. A range that failed to write is never published: the history stops
+// growing right before it and every append after it fails too.
+result_t history_publish(history_t* history, size_t offset, const struct iovec* iov, int count, size_t length,
+        result_t written) {
+    history_wait_turn(history, offset);
+    if (written == FAILURE && !history->write_failed) {
+        AESD_LOG(LOG_ERR, "history write failed at %zu, no more appends: %s", offset, strerror(errno));
+        __atomic_store_n(&history->write_failed, true, __ATOMIC_RELAXED);
+    }
+    if (history->write_failed) {
+        history_truncate(history, history->length);
+        history_pass_turn(history, offset + length);
+        errno = EIO;
+        return(FAILURE);
+    }
+    size_t record_offset = offset;
+    for (int i = 0; i < count; i++) {
+        history_index_records(history, record_offset, iov[i].iov_base, iov[i].iov_len);
+        record_offset += iov[i].iov_len;
+    }
+    if (history->retain_bytes != 0 || history->retain_records != 0) {
+        history_retain(history, offset + length);
+    }
+    __atomic_store_n(&history->length, offset + length, __ATOMIC_SEQ_CST);
+    history_pass_turn(history, offset + length);
+
+    if ((history->persist || history->sync != HISTORY_SYNC_NONE)
+            && __atomic_load_n(&history->persist_waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&history->mutex);
+        pthread_cond_signal(&history->persist_cond);
+        pthread_mutex_unlock(&history->mutex);
+    }
+    if (__atomic_load_n(&history->active_watchers, __ATOMIC_SEQ_CST) > 0) {
+        history_notify_watchers(history);
+    }
+    return SUCCESS;
+}
+
+// Give the write behind up to timeout_ms to catch up with everything published so far.
+void history_flush(history_t* history, int timeout_ms) {
+    if (!history->persist) {
+        return;
+    }
+    for (int waited_ms = 0; waited_ms < timeout_ms; waited_ms++) {
+        if (__atomic_load_n(&history->persisted, __ATOMIC_RELAXED)
+                == __atomic_load_n(&history->length, __ATOMIC_ACQUIRE)) {
+            return;
+        }
+        usleep(1000);
+    }
+    AESD_LOG(LOG_WARNING, "history write behind still behind after %d ms", timeout_ms);
+}
+
+// Append the data in iov (at most RECEIVE_CHAIN_MAX + 1 entries, length bytes in total) to
+// the history as one contiguous range. end is set to the history length right after this
+// append, which is how much an echo of the packet should send.
+result_t history_appendv(history_t* history, const struct iovec* iov, int count, size_t length, size_t* end) {
+    result_t result = SUCCESS;
+    size_t offset;
+    if (length == 0) {
+        return SUCCESS;
+    }
+    uint64_t start_ns = metrics_now_ns();
+
+    if (history->store == HISTORY_STORE_FILE) {
+        if (__atomic_load_n(&history->write_failed, __ATOMIC_RELAXED)) {
+            errno = EIO;
+            return(FAILURE);
+        }
+        struct iovec write_iov[RECEIVE_CHAIN_MAX + 1];
+        memcpy(write_iov, iov, count * sizeof(struct iovec));
+        offset = __atomic_fetch_add(&history->reserved, length, __ATOMIC_RELAXED);
+        if (history->segment_size != 0) {
+            result = history_files_writev(history, write_iov, count, offset, length);
+        } else {
+            result = pwritev_all(history->data_fd, write_iov, count, offset);
+        }
+        // A failed write still takes its publish turn, or every later append would wait
+        // on it forever.
+    } else {
+        history_cursor_t cursor;
+        pthread_mutex_lock(&history->mutex);
+        result = history_reserve_segments(history, length, &cursor);
+        pthread_mutex_unlock(&history->mutex);
+        if (result == FAILURE) {
+            return(FAILURE);
+        }
+        offset = cursor.offset;
+
+        for (int i = 0; i < count; i++) {
+            const char* data = iov[i].iov_base;
+            size_t remaining = iov[i].iov_len;
+            while (remaining > 0) {
+                if (cursor.segment_offset == HISTORY_SEGMENT_SIZE) {
+                    cursor.segment = cursor.segment->next;
+                    cursor.segment_offset = 0;
+                }
+                size_t span = HISTORY_SEGMENT_SIZE - cursor.segment_offset;
+                if (span > remaining) {
+                    span = remaining;
+                }
+                memcpy(cursor.segment->data + cursor.segment_offset, data, span);
+                cursor.segment_offset += span;
+                data += span;
+                remaining -= span;
+            }
+        }
+    }
+
+    result = history_publish(history, offset, iov, count, length, result);
+    if (end != NULL) {
+        *end = offset + length;
+    }
+    metrics_observe(&metrics_thread()->append_latency, metrics_now_ns() - start_ns);
+    return result;
+}
+
+result_t history_append(history_t* history, const char* data, size_t length, size_t* end) {
+    struct iovec iov = { .iov_base = (void*) data, .iov_len = length };
+    return history_appendv(history, &iov, 1, length, end);
+}
+
+// Map a chunk of the data file the first time a reader gets to it. The last chunk
+// usually reaches past the end of the file, that's fine as readers only touch bytes
+// below length. Mappings stay until exit, readers may still be sending out of them
+// while the server shuts down.
+const char* history_map_chunk(history_t* history, size_t chunk) {
+    char* map = __atomic_load_n(&history->maps[chunk], __ATOMIC_ACQUIRE);
+    if (map != NULL) {
+        return map;
+    }
+
+    pthread_mutex_lock(&history->maps_mutex);
+    map = history->maps[chunk];
+    if (map == NULL) {
+        map = mmap(NULL, HISTORY_MAP_CHUNK_SIZE, PROT_READ, MAP_SHARED, history->data_fd,
+            (off_t) chunk * HISTORY_MAP_CHUNK_SIZE);
+        if (map == MAP_FAILED) {
+            perror("mmap data file");
+            map = NULL;
+        } else {
+            // Echoes read the history front to back, let the kernel read ahead further.
+            if (madvise(map, HISTORY_MAP_CHUNK_SIZE, MADV_SEQUENTIAL) != 0) {
+                perror("madvise");
+            }
+            __atomic_store_n(&history->maps[chunk], map, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&history->maps_mutex);
+    return map;
+}
+
+void history_cursor_init(history_cursor_t* cursor) {
+    cursor->offset = 0;
+    cursor->segment = NULL;
+    cursor->segment_offset = 0;
+}
+
+// Send up to *span bytes of the file store at offset, trimming *span to what was tried.
+// Returns 0 if retention dropped the segment file before the reader got to it. Sends cut
+// short by the trimming carry MSG_MORE, the rest follows right away.
+ssize_t history_send_file(history_t* history, int peer_fd, size_t offset, size_t* span) {
+    size_t requested = *span;
+    history_file_t* file = NULL;
+    int fd = history->data_fd;
+    size_t file_offset = offset;
+    if (history->segment_size != 0) {
+        file = history_file_acquire(history, offset);
+        if (file == NULL) {
+            return 0;
+        }
+        fd = file->fd;
+        file_offset = offset % history->segment_size;
+        if (*span > history->segment_size - file_offset) {
+            *span = history->segment_size - file_offset;
+        }
+    }
+
+    // Bytes below end are already written, no lock needed. Another reader may switch
+    // read_path, only the local copy decides what this one does.
+    ssize_t sent_amount = -1;
+    history_read_t read_path = history->read_path;
+    if (read_path == HISTORY_READ_SENDFILE) {
+        // The kernel moves page cache pages to the socket, the history never passes
+        // through user space.
+        off_t sendfile_offset = file_offset;
+        sent_amount = sendfile(peer_fd, fd, &sendfile_offset, *span);
+        if (sent_amount == -1 && (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+            AESD_LOG(LOG_WARNING, "sendfile unsupported (%s), using buffered sends", strerror(errno));
+            read_path = HISTORY_READ_PREAD;
+            history->read_path = HISTORY_READ_PREAD;
+        } else if (sent_amount == 0) {
+            errno = EIO;
+            sent_amount = -1;
+        }
+    } else if (read_path == HISTORY_READ_MMAP) {
+        const char* map = NULL;
+        size_t map_offset = file_offset;
+        if (file != NULL) {
+            map = history_map_file(history, file);
+        } else if (file_offset / HISTORY_MAP_CHUNK_SIZE < HISTORY_MAP_CHUNKS) {
+            map = history_map_chunk(history, file_offset / HISTORY_MAP_CHUNK_SIZE);
+            map_offset = file_offset % HISTORY_MAP_CHUNK_SIZE;
+            if (*span > HISTORY_MAP_CHUNK_SIZE - map_offset) {
+                *span = HISTORY_MAP_CHUNK_SIZE - map_offset;
+            }
+        }
+        if (map == NULL) {
+            AESD_LOG(LOG_WARNING, "can't map the data file at %zu, using buffered sends", offset);
+            read_path = HISTORY_READ_PREAD;
+            history->read_path = HISTORY_READ_PREAD;
+        } else {
+            sent_amount = send(peer_fd, map + map_offset, *span, MSG_NOSIGNAL | (*span < requested ? MSG_MORE : 0));
+        }
+    }
+    if (read_path == HISTORY_READ_PREAD) {
+        char read_buffer[SEND_BUFFER_SIZE];
+        if (*span > SEND_BUFFER_SIZE) {
+            *span = SEND_BUFFER_SIZE;
+        }
+        ssize_t read_amount = pread(fd, read_buffer, *span, file_offset);
+        if (read_amount <= 0) {
+            if (read_amount == 0) {
+                errno = EIO;
+            }
+        } else {
+            *span = read_amount;
+            sent_amount = send(peer_fd, read_buffer, read_amount, MSG_NOSIGNAL | (*span < requested ? MSG_MORE : 0));
+        }
+    }
+
+    if (file != NULL) {
+        int send_errno = errno;
+        history_file_release(history, file);
+        errno = send_errno;
+    }
+    return sent_amount;
+}
+
+// Memory store: where the data at the cursor is, trimming *span to the rest of its segment.
+// Segments below end are complete and linked, the caller got end from the history after
+// the append that produced it.
+const char* history_segment_span(history_t* history, history_cursor_t* cursor, size_t* span) {
+    if (cursor->segment == NULL) {
+        cursor->segment = history->head;
+    } else if (cursor->segment_offset == HISTORY_SEGMENT_SIZE) {
+        cursor->segment = cursor->segment->next;
+        cursor->segment_offset = 0;
+    }
+    if (*span > HISTORY_SEGMENT_SIZE - cursor->segment_offset) {
+        *span = HISTORY_SEGMENT_SIZE - cursor->segment_offset;
+    }
+    return cursor->segment->data + cursor->segment_offset;
+}
+
+// Memory store: move the cursor on by amount, across as many segments as that takes.
+void history_cursor_advance(history_cursor_t* cursor, size_t amount) {
+    cursor->offset += amount;
+    while (amount > 0) {
+        if (cursor->segment_offset == HISTORY_SEGMENT_SIZE) {
+            cursor->segment = cursor->segment->next;
+            cursor->segment_offset = 0;
+        }
+        size_t piece = HISTORY_SEGMENT_SIZE - cursor->segment_offset;
+        piece = amount < piece ? amount : piece;
+        cursor->segment_offset += piece;
+        amount -= piece;
+    }
+}
+
+// Memory store: send the segments from the cursor on with one sendmsg(), up to
+// HISTORY_SEND_IOVS of them. *span is set to what was tried.
+ssize_t history_send_segments(history_t* history, int peer_fd, history_cursor_t* cursor, size_t end,
+        size_t* span) {
+    struct iovec iov[HISTORY_SEND_IOVS];
+    size_t remaining = end - cursor->offset;
+    size_t piece = remaining;
+    iov[0].iov_base = (void*) history_segment_span(history, cursor, &piece);
+    iov[0].iov_len = piece;
+    remaining -= piece;
+    int count = 1;
+    history_segment_t* segment = cursor->segment;
+    while (remaining > 0 && count < HISTORY_SEND_IOVS) {
+        segment = segment->next;
+        piece = remaining < HISTORY_SEGMENT_SIZE ? remaining : HISTORY_SEGMENT_SIZE;
+        iov[count].iov_base = segment->data;
+        iov[count].iov_len = piece;
+        remaining -= piece;
+        count += 1;
+    }
+    *span = end - cursor->offset - remaining;
+    struct msghdr message = { .msg_iov = iov, .msg_iovlen = count };
+    return sendmsg(peer_fd, &message, MSG_NOSIGNAL | (remaining > 0 ? MSG_MORE : 0));
+}
+
+// Send history from the cursor up to end, advancing the cursor by what was sent. Returns
+// the number of bytes sent, or -1 with errno set if nothing could be sent. A short count
+// means the socket would block or failed part way, the next call will report which.
+// Output is coalesced into as few segments as the socket allows: MSG_MORE on every send
+// with more to follow, and since sendfile() has none, TCP_CORK while sending spans across
+// segment files.
+ssize_t history_send(history_t* history, int peer_fd, history_cursor_t* cursor, size_t end) {
+    ssize_t total_sent = 0;
+    int corked = history->store == HISTORY_STORE_FILE && history->segment_size != 0
+        && history->read_path == HISTORY_READ_SENDFILE && cursor->offset < end
+        && cursor->offset / history->segment_size != (end - 1) / history->segment_size;
+    if (corked) {
+        setsockopt(peer_fd, IPPROTO_TCP, TCP_CORK, &corked, sizeof(corked));
+    }
+    while (cursor->offset < end) {
+        // Readers that fell behind retention skip what it dropped.
+        size_t start = __atomic_load_n(&history->start, __ATOMIC_ACQUIRE);
+        if (cursor->offset < start) {
+            cursor->offset = start;
+            continue;
+        }
+
+        size_t span = end - cursor->offset;
+        ssize_t sent_amount;
+        if (history->store == HISTORY_STORE_FILE) {
+            sent_amount = history_send_file(history, peer_fd, cursor->offset, &span);
+            if (sent_amount == 0) {
+                continue;
+            }
+        } else {
+            sent_amount = history_send_segments(history, peer_fd, cursor, end, &span);
+        }
+
+        if (sent_amount == -1) {
+            if (total_sent == 0) {
+                total_sent = -1;
+            }
+            break;
+        }
+        if (history->store == HISTORY_STORE_FILE) {
+            cursor->offset += sent_amount;
+        } else {
+            history_cursor_advance(cursor, sent_amount);
+        }
+        total_sent += sent_amount;
+        if ((size_t) sent_amount < span) {
+            break;
+        }
+    }
+    if (corked) {
+        int send_errno = errno;
+        int uncorked = 0;
+        setsockopt(peer_fd, IPPROTO_TCP, TCP_CORK, &uncorked, sizeof(uncorked));
+        errno = send_errno;
+    }
+    return total_sent;
+}
+
+// MARK: Housekeeping
+
+// The current local time, formatted at most once per second however many jobs ask.
+// Only the housekeeping thread uses it.
+const char* housekeeping_clock(housekeeping_t* housekeeping) {
+    time_t now = time(NULL);
+    if (now != housekeeping->clock_second) {
+        struct tm local;
+        localtime_r(&now, &local);
+        strftime(housekeeping->clock, sizeof(housekeeping->clock), "%a, %d %b %Y %T %z", &local);
+        housekeeping->clock_second = now;
+    }
+    return housekeeping->clock;
+}
+
+void append_timestamp(aesdsocket_t* aesdsocket) {
+    char buffer[128];
+    int length = snprintf(buffer, sizeof(buffer), "timestamp:%s\n", housekeeping_clock(&aesdsocket->housekeeping));
+    AESD_LOG(LOG_DEBUG, "%s", buffer);
+    AESD_LOG(LOG_DEBUG, "connections: %d", __atomic_load_n(&aesdsocket->connections_count, __ATOMIC_RELAXED));
+    if (history_append(&aesdsocket->history, buffer, length, NULL) == FAILURE) {
+        AESD_LOG(LOG_ERR, "timestamp append failed");
+    }
+}
+
+void sync_index(aesdsocket_t* aesdsocket) {
+    history_index_sync(&aesdsocket->history);
+}
+
+result_t housekeeping_add(housekeeping_t* housekeeping, const char* name, int interval_ms,
+        void (*run)(aesdsocket_t* aesdsocket)) {
+    if (housekeeping->job_count == HOUSEKEEPING_JOBS_MAX) {
+        fprintf(stderr, "too many housekeeping jobs\n");
+        return(FAILURE);
+    }
+    housekeeping_job_t* job = &housekeeping->jobs[housekeeping->job_count];
+    job->name = name;
+    job->interval_ms = interval_ms;
+    job->run = run;
+    job->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (job->timer_fd == -1) {
+        perror("timerfd_create");
+        return(FAILURE);
+    }
+    struct itimerspec its = { 0 };
+    its.it_interval.tv_sec = interval_ms / 1000;
+    its.it_interval.tv_nsec = (long) (interval_ms % 1000) * 1000000;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(job->timer_fd, 0, &its, NULL) == -1) {
+        perror("timerfd_settime");
+        close(job->timer_fd);
+        return(FAILURE);
+    }
+    struct epoll_event event = { 0 };
+    event.events = EPOLLIN;
+    event.data.ptr = job;
+    if (epoll_ctl(housekeeping->epoll_fd, EPOLL_CTL_ADD, job->timer_fd, &event) != 0) {
+        perror("epoll_ctl add timer_fd");
+        close(job->timer_fd);
+        return(FAILURE);
+    }
+    housekeeping->job_count += 1;
+    syslog(LOG_DEBUG, "housekeeping job %s every %d ms", name, interval_ms);
+    return SUCCESS;
+}
+
+void* manage_housekeeping_thread(void* arg) {
+    aesdsocket_t* aesdsocket = (aesdsocket_t*) arg;
+    housekeeping_t* housekeeping = &aesdsocket->housekeeping;
+    struct epoll_event events[HOUSEKEEPING_JOBS_MAX + 1];
+    while (true) {
+        int event_count = epoll_wait(housekeeping->epoll_fd, events, HOUSEKEEPING_JOBS_MAX + 1, -1);
+        if (event_count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait housekeeping");
+            return NULL;
+        }
+        for (int i = 0; i < event_count; i++) {
+            // The stop eventfd is the only registration without a job.
+            if (events[i].data.ptr == NULL) {
+                return NULL;
+            }
+            housekeeping_job_t* job = (housekeeping_job_t*) events[i].data.ptr;
+            // Ticks missed while a job ran late collapse into one run.
+            uint64_t expirations;
+            if (read(job->timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+                continue;
+            }
+            if (expirations > 1) {
+                AESD_LOG(LOG_DEBUG, "housekeeping job %s missed %ju ticks", job->name, (uintmax_t) (expirations - 1));
+            }
+            job->run(aesdsocket);
+        }
+    }
+}
+
+result_t housekeeping_start(aesdsocket_t* aesdsocket) {
+    housekeeping_t* housekeeping = &aesdsocket->housekeeping;
+    housekeeping->job_count = 0;
+    housekeeping->clock_second = -1;
+    housekeeping->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    housekeeping->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (housekeeping->epoll_fd == -1 || housekeeping->stop_fd == -1) {
+        perror("housekeeping epoll_create1/eventfd");
+        return(FAILURE);
+    }
+    struct epoll_event event = { 0 };
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(housekeeping->epoll_fd, EPOLL_CTL_ADD, housekeeping->stop_fd, &event) != 0) {
+        perror("epoll_ctl add stop_fd");
+        return(FAILURE);
+    }
+
+    if (housekeeping_add(housekeeping, "timestamp", TIMESTAMP_INTERVAL_MS, append_timestamp) == FAILURE) {
+        return(FAILURE);
+    }
+    if (aesdsocket->history.persist_index
+            && housekeeping_add(housekeeping, "index sync", INDEX_SYNC_INTERVAL_MS, sync_index) == FAILURE) {
+        return(FAILURE);
+    }
+
+    if (pthread_create(&housekeeping->thread_id, NULL, manage_housekeeping_thread, aesdsocket) != 0) {
+        perror("pthread_create");
+        return(FAILURE);
+    }
+    return SUCCESS;
+}
+
+// Lets a job that is already running finish, unlike cancelling the thread mid-append.
+void housekeeping_stop(housekeeping_t* housekeeping) {
+    uint64_t one = 1;
+    if (write(housekeeping->stop_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("write stop_fd");
+        return;
+    }
+    int join_result = pthread_join(housekeeping->thread_id, NULL);
+    if (join_result != 0) {
+        errno = join_result;
+        perror("pthread_join");
+    }
+    for (int i = 0; i < housekeeping->job_count; i++) {
+        close(housekeeping->jobs[i].timer_fd);
+    }
+    close(housekeeping->epoll_fd);
+    close(housekeeping->stop_fd);
+}
+
+// MARK: Receive buffers
+
+result_t receive_chain_init(receive_chain_t* chain, int count, size_t buffer_size) {
+    chain->count = 0;
+    for (int i = 0; i < count; i++) {
+        chain->iov[i].iov_base = malloc(buffer_size);
+        if (chain->iov[i].iov_base == NULL) {
+            perror("malloc receive buffer");
+            return(FAILURE);
+        }
+        chain->iov[i].iov_len = buffer_size;
+        chain->count += 1;
+    }
+    return SUCCESS;
+}
+
+// Same chain carved out of an arena, freed by resetting the arena.
+result_t receive_chain_init_arena(receive_chain_t* chain, arena_t* arena, int count, size_t buffer_size) {
+    size_t aligned = (buffer_size + ARENA_ALIGNMENT - 1) & ~((size_t) ARENA_ALIGNMENT - 1);
+    if (arena_reset(arena, aligned * count) == FAILURE) {
+        return(FAILURE);
+    }
+    for (int i = 0; i < count; i++) {
+        chain->iov[i].iov_base = arena_alloc(arena, buffer_size);
+        chain->iov[i].iov_len = buffer_size;
+    }
+    chain->count = count;
+    return SUCCESS;
+}
+
+void receive_chain_free(receive_chain_t* chain) {
+    for (int i = 0; i < chain->count; i++) {
+        free(chain->iov[i].iov_base);
+    }
+    chain->count = 0;
+}
+
+// Fill the chain with one readv(). On success received describes the filled part of the
+// chain and the return value is its number of entries, otherwise readv()'s 0 or -1.
+ssize_t receive_chain_read(receive_chain_t* chain, int peer_fd, struct iovec* received, size_t* length) {
+    ssize_t bytes_received = readv(peer_fd, chain->iov, chain->count);
+    if (bytes_received <= 0) {
+        return bytes_received;
+    }
+    *length = bytes_received;
+
+    int count = 0;
+    size_t remaining = bytes_received;
+    while (remaining > 0) {
+        received[count].iov_base = chain->iov[count].iov_base;
+        received[count].iov_len = remaining < chain->iov[count].iov_len ? remaining : chain->iov[count].iov_len;
+        remaining -= received[count].iov_len;
+        count += 1;
+    }
+    return count;
+}
+
+// Add length bytes of iov to the staged record, growing the buffer by doubling. Fails
+// with EMSGSIZE if the record would outgrow max_record.
+result_t staging_add(staging_t* staging, const struct iovec* iov, int count, size_t length, size_t max_record) {
+    if (staging->length + length > max_record) {
+        errno = EMSGSIZE;
+        return(FAILURE);
+    }
+    if (staging->length + length > staging->capacity) {
+        size_t capacity = staging->capacity > 0 ? staging->capacity : STAGING_MIN_CAPACITY;
+        while (capacity < staging->length + length) {
+            capacity *= 2;
+        }
+        if (capacity > max_record) {
+            capacity = max_record;
+        }
+        char* data = realloc(staging->data, capacity);
+        if (data == NULL) {
+            perror("realloc staging");
+            return(FAILURE);
+        }
+        staging->data = data;
+        staging->capacity = capacity;
+    }
+    for (int i = 0; i < count; i++) {
+        memcpy(staging->data + staging->length, iov[i].iov_base, iov[i].iov_len);
+        staging->length += iov[i].iov_len;
+    }
+    return SUCCESS;
+}
+
+void staging_free(staging_t* staging) {
+    free(staging->data);
+    *staging = (staging_t) { 0 };
+}
+
+// Append the records received completes to the history, behind what was staged of the
+// first one, and stage whatever follows the last newline. With a pipeline, its packets
+// are framed. Fails with EMSGSIZE, appending nothing, if any record, complete or staged,
+// outgrows max_record. The peer is expected to be closed then.
+result_t receive_records(history_t* history, staging_t* staging, pipeline_t* pipeline, size_t max_record,
+        const struct iovec* received, int count, size_t length) {
+    int last = count - 1;
+    const char* newline = NULL;
+    for (; last >= 0 && newline == NULL; last--) {
+        newline = memrchr(received[last].iov_base, '\n', received[last].iov_len);
+    }
+    if (newline == NULL) {
+        return staging_add(staging, received, count, length, max_record);
+    }
+    last += 1;
+
+    // Every complete record has to fit, the first one along with what was staged of it,
+    // and so does the start of the record after the last newline, which gets staged.
+    size_t tail_length = received[last].iov_len - (newline + 1 - (const char*) received[last].iov_base);
+    for (int i = last + 1; i < count; i++) {
+        tail_length += received[i].iov_len;
+    }
+    if (tail_length > max_record) {
+        errno = EMSGSIZE;
+        return(FAILURE);
+    }
+    size_t record_length = staging->length;
+    for (int i = 0; i <= last; i++) {
+        const char* data = received[i].iov_base;
+        const char* data_end = i == last ? newline + 1 : data + received[i].iov_len;
+        while (data < data_end) {
+            const char* found = memchr(data, '\n', data_end - data);
+            const char* record_end = found != NULL ? found + 1 : data_end;
+            record_length += record_end - data;
+            if (record_length > max_record) {
+                errno = EMSGSIZE;
+                return(FAILURE);
+            }
+            if (found != NULL) {
+                record_length = 0;
+            }
+            data = record_end;
+        }
+    }
+
+    struct iovec records[RECEIVE_CHAIN_MAX + 1];
+    int records_count = 0;
+    size_t records_length = staging->length;
+    if (staging->length > 0) {
+        records[records_count++] = (struct iovec) { staging->data, staging->length };
+    }
+    for (int i = 0; i <= last; i++) {
+        records[records_count] = received[i];
+        if (i == last) {
+            records[records_count].iov_len = newline - (const char*) received[i].iov_base + 1;
+        }
+        records_length += records[records_count].iov_len;
+        records_count += 1;
+    }
+    size_t end = 0;
+    size_t staged = staging->length;
+    staging->length = 0;
+    if (history_appendv(history, records, records_count, records_length, &end) == FAILURE) {
+        return(FAILURE);
+    }
+    if (pipeline != NULL) {
+        pipeline_appended(history, pipeline, records_length, end);
+    }
+
+    struct iovec rest[RECEIVE_CHAIN_MAX];
+    int rest_count = 0;
+    size_t head = records[records_count - 1].iov_len;
+    if (head < received[last].iov_len) {
+        rest[rest_count++] = (struct iovec) {
+            (char*) received[last].iov_base + head, received[last].iov_len - head
+        };
+    }
+    for (int i = last + 1; i < count; i++) {
+        rest[rest_count++] = received[i];
+    }
+    return staging_add(staging, rest, rest_count, length - (records_length - staged), max_record);
+}
+
+// The peer's record outgrew max_record, it's closed rather than held any longer.
+void record_rejected(uint32_t id, size_t max_record) {
+    metrics_add(&metrics_thread()->records_rejected, 1);
+    AESD_LOG(LOG_WARNING, "(%d) record longer than %zu bytes, closing", id, max_record);
+}
+
+bool parse_number(const char** cursor, uint64_t* value) {
+    if (**cursor < '0' || **cursor > '9') {
+        return false;
+    }
+    char* end;
+    *value = strtoull(*cursor, &end, 10);
+    *cursor = end;
+    return true;
+}
+
+// "AESDCHAR_IOCSEEKTO:X,Y\n" asks for the history from byte Y of record X onwards and
+// isn't appended. Only recognized when the whole command comes in the first read of a
+// packet, it is short enough that it always does in practice.
+bool parse_seek_command(const struct iovec* received, int count, size_t length, uint64_t* record, uint64_t* offset) {
+    char command[SEEK_COMMAND_MAX + 1];
+    if (length > SEEK_COMMAND_MAX || length <= strlen(SEEK_COMMAND)) {
+        return false;
+    }
+    size_t copied = 0;
+    for (int i = 0; i < count; i++) {
+        memcpy(command + copied, received[i].iov_base, received[i].iov_len);
+        copied += received[i].iov_len;
+    }
+    command[length] = '\0';
+    if (strncmp(command, SEEK_COMMAND, strlen(SEEK_COMMAND)) != 0) {
+        return false;
+    }
+
+    const char* cursor = command + strlen(SEEK_COMMAND);
+    if (!parse_number(&cursor, record) || *cursor++ != ',' || !parse_number(&cursor, offset)) {
+        return false;
+    }
+    return cursor == command + length - 1 && *cursor == '\n';
+}
+
+// MARK: Rate limiting
+
+void rate_limiter_init(rate_limiter_t* limiter, size_t bytes_per_second, size_t records_per_second) {
+    limiter->bytes_per_second = bytes_per_second;
+    limiter->records_per_second = records_per_second;
+    for (int i = 0; i < RATE_LIMIT_SLOTS; i++) {
+        pthread_mutex_init(&limiter->slots[i].mutex, NULL);
+        limiter->slots[i].buckets = NULL;
+    }
+}
+
+// Top the bucket up for the time since its last refill, locked by its slot.
+void rate_bucket_refill(rate_limiter_t* limiter, rate_bucket_t* bucket, uint64_t now_ns) {
+    double elapsed = (now_ns - bucket->refill_ns) / 1e9;
+    bucket->refill_ns = now_ns;
+    bucket->bytes += elapsed * limiter->bytes_per_second;
+    if (bucket->bytes > limiter->bytes_per_second) {
+        bucket->bytes = limiter->bytes_per_second;
+    }
+    bucket->records += elapsed * limiter->records_per_second;
+    if (bucket->records > limiter->records_per_second) {
+        bucket->records = limiter->records_per_second;
+    }
+}
+
+bool rate_bucket_full(rate_limiter_t* limiter, rate_bucket_t* bucket) {
+    return bucket->bytes >= limiter->bytes_per_second && bucket->records >= limiter->records_per_second;
+}
+
+// Bucket of the peer's address, shared with its other connections. NULL without limits.
+// Unused buckets stay around until they refilled, so reconnecting doesn't wipe a debt,
+// and get freed by the next lookup in their slot after that.
+rate_bucket_t* rate_limit_acquire(rate_limiter_t* limiter, const struct sockaddr* peer) {
+    if (limiter->bytes_per_second == 0 && limiter->records_per_second == 0) {
+        return NULL;
+    }
+    struct in6_addr address = { 0 };
+    if (peer->sa_family == AF_INET6) {
+        address = ((const struct sockaddr_in6*) peer)->sin6_addr;
+    } else if (peer->sa_family == AF_INET) {
+        address.s6_addr[10] = 0xff;
+        address.s6_addr[11] = 0xff;
+        memcpy(&address.s6_addr[12], &((const struct sockaddr_in*) peer)->sin_addr, 4);
+    }
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 16; i++) {
+        hash = (hash ^ address.s6_addr[i]) * 16777619u;
+    }
+    rate_slot_t* slot = &limiter->slots[hash % RATE_LIMIT_SLOTS];
+    uint64_t now_ns = metrics_now_ns();
+
+    pthread_mutex_lock(&slot->mutex);
+    rate_bucket_t* found = NULL;
+    rate_bucket_t** link = &slot->buckets;
+    while (*link != NULL) {
+        rate_bucket_t* bucket = *link;
+        if (memcmp(&bucket->address, &address, sizeof(address)) == 0) {
+            found = bucket;
+        } else if (bucket->users == 0) {
+            rate_bucket_refill(limiter, bucket, now_ns);
+            if (rate_bucket_full(limiter, bucket)) {
+                *link = bucket->next;
+                free(bucket);
+                continue;
+            }
+        }
+        link = &bucket->next;
+    }
+    if (found == NULL) {
+        found = malloc(sizeof(rate_bucket_t));
+        if (found == NULL) {
+            // Better unlimited than refused.
+            pthread_mutex_unlock(&slot->mutex);
+            perror("malloc rate bucket");
+            return NULL;
+        }
+        found->address = address;
+        found->users = 0;
+        found->bytes = limiter->bytes_per_second;
+        found->records = limiter->records_per_second;
+        found->refill_ns = now_ns;
+        found->slot = slot;
+        found->next = slot->buckets;
+        slot->buckets = found;
+    }
+    found->users += 1;
+    pthread_mutex_unlock(&slot->mutex);
+    return found;
+}
+
+void rate_limit_release(rate_bucket_t* bucket) {
+    if (bucket == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&bucket->slot->mutex);
+    bucket->users -= 1;
+    pthread_mutex_unlock(&bucket->slot->mutex);
+}
+
+// Charge a read to the peer's bucket. Returns how many ns its connections should hold off
+// reading, 0 while the bucket isn't in debt.
+uint64_t rate_limit_received(rate_limiter_t* limiter, rate_bucket_t* bucket, const struct iovec* received,
+        int count, size_t length) {
+    if (bucket == NULL) {
+        return 0;
+    }
+    size_t records = 0;
+    if (limiter->records_per_second > 0) {
+        for (int i = 0; i < count; i++) {
+            records += count_newlines(received[i].iov_base, received[i].iov_len);
+        }
+    }
+
+    double wait = 0;
+    pthread_mutex_lock(&bucket->slot->mutex);
+    rate_bucket_refill(limiter, bucket, metrics_now_ns());
+    if (limiter->bytes_per_second > 0) {
+        bucket->bytes -= length;
+        if (bucket->bytes < 0) {
+            wait = -bucket->bytes / limiter->bytes_per_second;
+        }
+    }
+    if (limiter->records_per_second > 0) {
+        bucket->records -= records;
+        if (bucket->records < 0 && -bucket->records / limiter->records_per_second > wait) {
+            wait = -bucket->records / limiter->records_per_second;
+        }
+    }
+    pthread_mutex_unlock(&bucket->slot->mutex);
+    if (wait == 0) {
+        return 0;
+    }
+    metrics_add(&metrics_thread()->reads_throttled, 1);
+    return (uint64_t) (wait * 1e9) + 1;
+}
+
+// Connection threads: sleep until resume_ns, cut short by shutdown so draining doesn't
+// wait on it.
+void throttle_wait(aesdsocket_t* aesdsocket, uint64_t resume_ns) {
+    uint64_t now_ns;
+    while ((now_ns = metrics_now_ns()) < resume_ns) {
+        struct pollfd poll_shutdown = { .fd = aesdsocket->shutdown_fd, .events = POLLIN };
+        int ready = poll(&poll_shutdown, 1, (int) ((resume_ns - now_ns + 999999) / 1000000));
+        if (ready > 0 || (ready == -1 && errno != EINTR)) {
+            return;
+        }
+    }
+}
+
+// MARK: Connection threads
+
+// A following peer usually leaves by closing with data still unread, which shows up as
+// a reset rather than an orderly end of stream.
+bool peer_gone(int error) {
+    return error == ECONNRESET || error == EPIPE;
+}
+
+// Blocking send of the history from cursor up to end.
+result_t send_history(history_t* history, int peer_fd, history_cursor_t* cursor, size_t end) {
+    while (cursor->offset < end) {
+        ssize_t sent_amount = history_send(history, peer_fd, cursor, end);
+        AESD_LOG(LOG_DEBUG, "send: %zd", sent_amount);
+
+        if (sent_amount == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (!peer_gone(errno)) {
+                perror("send failed");
+            }
+            return(FAILURE);
+        }
+        metrics_add(&metrics_thread()->bytes_sent, sent_amount);
+    }
+    return(SUCCESS);
+}
+
+// Tail mode: after the echo, keep streaming whatever gets appended until the peer closes
+// or the server shuts down. Anything else the peer sends is appended as usual, a rate
+// limited peer just isn't read for a while.
+result_t follow_peer(aesdsocket_t* aesdsocket, receive_chain_t* receive_chain, staging_t* staging,
+        rate_bucket_t* rate_bucket, uint32_t id, int peer_fd, history_cursor_t* cursor) {
+    history_t* history = &aesdsocket->history;
+    history_watcher_t* watcher = history_add_watcher(history);
+    if (watcher == NULL) {
+        return(FAILURE);
+    }
+    history_watch(history, watcher, true);
+    AESD_LOG(LOG_DEBUG, "(%d) following", id);
+
+    result_t result = SUCCESS;
+    uint64_t resume_ns = 0;
+    while (result == SUCCESS) {
+        history_watcher_rearm(watcher);
+        size_t end = __atomic_load_n(&history->length, __ATOMIC_ACQUIRE);
+        if (send_history(history, peer_fd, cursor, end) == FAILURE) {
+            result = peer_gone(errno) ? SUCCESS : FAILURE;
+            break;
+        }
+
+        uint64_t now_ns = metrics_now_ns();
+        bool throttled = resume_ns > now_ns;
+        struct pollfd polls[3] = {
+            { .fd = throttled ? -1 : peer_fd, .events = POLLIN },
+            { .fd = watcher->event_fd, .events = POLLIN },
+            { .fd = aesdsocket->shutdown_fd, .events = POLLIN },
+        };
+        if (poll(polls, 3, throttled ? (int) ((resume_ns - now_ns + 999999) / 1000000) : -1) == -1) {
+            if (errno != EINTR) {
+                perror("poll");
+                result = FAILURE;
+            }
+            continue;
+        }
+        if (polls[2].revents != 0) {
+            break;
+        }
+        if (polls[0].revents != 0) {
+            struct iovec received[RECEIVE_CHAIN_MAX];
+            size_t bytes_received = 0;
+            ssize_t received_count = receive_chain_read(receive_chain, peer_fd, received, &bytes_received);
+            if (received_count == 0) {
+                AESD_LOG(LOG_DEBUG, "(%d) end of receive data", id);
+                break;
+            } else if (received_count < 0) {
+                if (peer_gone(errno)) {
+                    break;
+                } else if (errno != EINTR) {
+                    perror("recv failed");
+                    result = FAILURE;
+                }
+                continue;
+            }
+            log_payload(id, peer_fd, received[0].iov_base, bytes_received);
+            metrics_add(&metrics_thread()->bytes_received, bytes_received);
+            size_t max_record = aesdsocket->config.max_record;
+            result = receive_records(history, staging, NULL, max_record, received, received_count, bytes_received);
+            if (result == FAILURE && errno == EMSGSIZE) {
+                record_rejected(id, max_record);
+                result = SUCCESS;
+                break;
+            }
+            uint64_t wait_ns = rate_limit_received(&aesdsocket->rate_limiter, rate_bucket, received,
+                received_count, bytes_received);
+            resume_ns = wait_ns > 0 ? metrics_now_ns() + wait_ns : 0;
+        }
+    }
+    history_remove_watcher(history, watcher);
+    return result;
+}
+
+// Keep-alive: wait for the next packet. Returns 1 once the peer sent something, 0 if it
+// stayed quiet for the idle timeout or the server is shutting down, -1 on errors.
+int wait_for_packet(aesdsocket_t* aesdsocket, int peer_fd) {
+    struct pollfd polls[2] = {
+        { .fd = peer_fd, .events = POLLIN },
+        { .fd = aesdsocket->shutdown_fd, .events = POLLIN },
+    };
+    int timeout_ms = aesdsocket->config.idle_timeout > 0 ? aesdsocket->config.idle_timeout * 1000 : -1;
+    while (true) {
+        int ready = poll(polls, 2, timeout_ms);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            return -1;
+        }
+        return ready > 0 && polls[1].revents == 0 ? 1 : 0;
+    }
+}
+
+// Serve one peer until it's done: the echo of each packet, and with tail mode whatever
+// gets appended after it.
+int serve_peer(aesdsocket_t* aesdsocket, receive_chain_t* receive_chain, staging_t* staging,
+        rate_bucket_t* rate_bucket, uint32_t id, int peer_fd) {
+    history_t* history = &aesdsocket->history;
+
+    // Receive data until we get a newline, staging it until the packet is complete. A
+    // keep-alive connection goes around again after the echo, first echoing whatever other
+    // packets its last append completed.
+    bool keep_alive = aesdsocket->config.keep_alive;
+    size_t max_record = aesdsocket->config.max_record;
+    pipeline_t pipeline = { .whole = !keep_alive };
+    uint64_t resume_ns = 0;
+    history_cursor_t cursor;
+    while (true) {
+        size_t send_end = 0;
+        bool seeked = false;
+        history_cursor_init(&cursor);
+        while (!pipeline_next(history, &pipeline, &send_end)) {
+            if (resume_ns != 0) {
+                throttle_wait(aesdsocket, resume_ns);
+                resume_ns = 0;
+            }
+            if (keep_alive && staging->length == 0) {
+                int ready = wait_for_packet(aesdsocket, peer_fd);
+                if (ready <= 0) {
+                    AESD_LOG(LOG_DEBUG, "(%d) %s", id, ready == 0 ? "idle, closing" : "wait failed");
+                    return ready == 0 ? SUCCESS : FAILURE;
+                }
+            }
+            struct iovec received[RECEIVE_CHAIN_MAX];
+            size_t bytes_received = 0;
+            ssize_t received_count = receive_chain_read(receive_chain, peer_fd, received, &bytes_received);
+            if (received_count < 0) {
+                if (errno == EINTR) {
+                    continue;
+                } else if (keep_alive && peer_gone(errno)) {
+                    return(SUCCESS);
+                }
+                perror("recv failed");
+                return(FAILURE);
+            } else if (received_count == 0) {
+                AESD_LOG(LOG_DEBUG, "end of receive data");
+                return(SUCCESS);
+            }
+            log_payload(id, peer_fd, received[0].iov_base, bytes_received);
+            metrics_add(&metrics_thread()->bytes_received, bytes_received);
+
+            uint64_t seek_record;
+            uint64_t seek_offset;
+            if (staging->length == 0
+                    && parse_seek_command(received, received_count, bytes_received, &seek_record, &seek_offset)) {
+                if (history_seek(history, seek_record, seek_offset, &cursor) == FAILURE) {
+                    AESD_LOG(LOG_WARNING, "(%d) invalid seek to record %ju offset %ju", id,
+                        (uintmax_t) seek_record, (uintmax_t) seek_offset);
+                    return(SUCCESS);
+                }
+                send_end = __atomic_load_n(&history->length, __ATOMIC_ACQUIRE);
+                seeked = true;
+                break;
+            }
+
+            if (receive_records(history, staging, &pipeline, max_record, received, received_count,
+                    bytes_received) == FAILURE) {
+                if (errno == EMSGSIZE) {
+                    record_rejected(id, max_record);
+                    return(SUCCESS);
+                }
+                AESD_LOG(LOG_ERR, "history append failed");
+                return(FAILURE);
+            }
+            uint64_t wait_ns = rate_limit_received(&aesdsocket->rate_limiter, rate_bucket, received,
+                received_count, bytes_received);
+            resume_ns = wait_ns > 0 ? metrics_now_ns() + wait_ns : 0;
+        }
+
+        if (!seeked && history->sync != HISTORY_SYNC_NONE
+                && history_wait_durable(history, send_end) == FAILURE) {
+            AESD_LOG(LOG_ERR, "(%d) history sync failed, not echoing", id);
+            return(FAILURE);
+        }
+
+        // Send the history, up to and including this packet or from the seek position on, back
+        // to the peer.
+        uint64_t echo_start_ns = metrics_now_ns();
+        if (send_history(history, peer_fd, &cursor, send_end) == FAILURE) {
+            return keep_alive && peer_gone(errno) ? SUCCESS : FAILURE;
+        }
+        metrics_observe(&metrics_thread()->echo_latency, metrics_now_ns() - echo_start_ns);
+        if (!keep_alive) {
+            break;
+        }
+    }
+
+    if (aesdsocket->config.tail) {
+        return follow_peer(aesdsocket, receive_chain, staging, rate_bucket, id, peer_fd, &cursor);
+    }
+    return(SUCCESS);
+}
+
+int handle_peer(aesdsocket_t* aesdsocket, receive_chain_t* receive_chain, staging_t* staging, uint32_t id,
+        int peer_fd) {
+    struct sockaddr_storage peer_address;
+    socklen_t peer_address_length = sizeof(peer_address);
+    pthread_t thread_id = pthread_self();
+
     if (getpeername(peer_fd, (struct sockaddr *)&peer_address, &peer_address_length) != 0) {
         perror("getpeername failed");
         return(FAILURE);
     }
 
-    char client_ip[INET_ADDRSTRLEN];
-    if (inet_ntop(AF_INET, &peer_address.sin_addr, client_ip, INET_ADDRSTRLEN) == NULL) {
-        perror("inet_ntop failed");
+    char client_ip[INET6_ADDRSTRLEN];
+    const void* peer_ip = peer_address.ss_family == AF_INET6
+        ? (const void*) &((struct sockaddr_in6*) &peer_address)->sin6_addr
+        : (const void*) &((sockaddr_in_t*) &peer_address)->sin_addr;
+    if (inet_ntop(peer_address.ss_family, peer_ip, client_ip, sizeof(client_ip)) == NULL) {
+        perror("inet_ntop failed");
+        return(FAILURE);
+    }
+
+    AESD_LOG(LOG_INFO, "Accepted connection from %s, id: %d, peer_fd: %d, thread_id: %ld",
+        client_ip, id, peer_fd, thread_id);
+
+    rate_bucket_t* rate_bucket = rate_limit_acquire(&aesdsocket->rate_limiter, (struct sockaddr*) &peer_address);
+    int result = serve_peer(aesdsocket, receive_chain, staging, rate_bucket, id, peer_fd);
+    rate_limit_release(rate_bucket);
+    return result;
+}
+
+void* manage_connection_thread(void* arg) {
+    AESD_LOG(LOG_DEBUG, "manage_connection_thread()");
+    connection_entry_t* entry = (connection_entry_t*) arg;
+    uint32_t id = entry->id;
+    int peer_fd = entry->peer_fd;
+
+    // The receive buffers come with the pooled entry, a reused entry allocates nothing. Like
+    // in the pool mode, a failed peer only costs its own socket, the rest keep being served.
+    receive_chain_t receive_chain;
+    staging_t staging = { 0 };
+    if (receive_chain_init_arena(&receive_chain, &entry->arena, g_aesdsocket.config.receive_buffers,
+            g_aesdsocket.config.receive_buffer_size) == FAILURE
+            || handle_peer(&g_aesdsocket, &receive_chain, &staging, id, peer_fd) == FAILURE) {
+        AESD_LOG(LOG_ERR, "handle_peer failed for connection %d: %s", id, strerror(errno));
+    }
+    staging_free(&staging);
+    close(peer_fd);
+    metrics_add(&metrics_thread()->connections_closed, 1);
+
+    AESD_LOG(LOG_DEBUG, "thread %d - %ld done", id, pthread_self());
+    registry_complete(&g_aesdsocket.registry, entry);
+    return NULL;
+}
+
+// MARK: Event loop
+
+// Raise the soft open file limit to the hard limit, every connection in the event loop
+// mode holds a descriptor so the default limit of 1024 caps the concurrent clients.
+void raise_open_file_limit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+        perror("getrlimit");
+        return;
+    }
+    if (limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+            perror("setrlimit");
+            return;
+        }
+    }
+    syslog(LOG_DEBUG, "open file limit: %ju", (uintmax_t) limit.rlim_cur);
+}
+
+result_t set_non_blocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl O_NONBLOCK");
+        return(FAILURE);
+    }
+    return SUCCESS;
+}
+
+// The loop's watcher is only active while it has followers or echoes waiting to sync.
+void event_loop_watch(aesdsocket_t* aesdsocket, event_loop_t* event_loop) {
+    bool watching = !LIST_EMPTY(&event_loop->following) || !LIST_EMPTY(&event_loop->syncing);
+    if (watching != event_loop->watching) {
+        history_watch(&aesdsocket->history, event_loop->watcher, watching);
+        if (watching) {
+            history_watcher_rearm(event_loop->watcher);
+        }
+        event_loop->watching = watching;
+    }
+}
+
+void stop_syncing(aesdsocket_t* aesdsocket, event_loop_t* event_loop, connection_t* connection) {
+    LIST_REMOVE(connection, syncing_entries);
+    connection->state = CONNECTION_SENDING;
+    event_loop_watch(aesdsocket, event_loop);
+}
+
+// Under a sync policy the echo waits until its packet is durable. The persist thread
+// notifies the watchers whenever durable moves.
+void start_syncing(aesdsocket_t* aesdsocket, event_loop_t* event_loop, connection_t* connection) {
+    if (history_durable(&aesdsocket->history, connection->send_end)) {
+        return;
+    }
+    LIST_INSERT_HEAD(&event_loop->syncing, connection, syncing_entries);
+    connection->state = CONNECTION_SYNCING;
+    event_loop_watch(aesdsocket, event_loop);
+    // Durable may have moved before the watcher was active, that wakeup went nowhere.
+    if (history_durable(&aesdsocket->history, connection->send_end)) {
+        stop_syncing(aesdsocket, event_loop, connection);
+    }
+}
+
+// Start echoing the next packet the connection completed, if there is one.
+bool connection_next_packet(aesdsocket_t* aesdsocket, event_loop_t* event_loop, connection_t* connection) {
+    size_t send_end = 0;
+    if (!pipeline_next(&aesdsocket->history, &connection->pipeline, &send_end)) {
+        return false;
+    }
+    connection->state = CONNECTION_SENDING;
+    connection->send_end = send_end;
+    connection->echo_start_ns = metrics_now_ns();
+    history_cursor_init(&connection->cursor);
+    if (aesdsocket->history.sync != HISTORY_SYNC_NONE) {
+        start_syncing(aesdsocket, event_loop, connection);
+    }
+    return true;
+}
+
+// Drain the socket until it would block, appending complete records to the history and
+// staging the rest. Once the packet's newline arrives, the echo covers the history up to
+// and including it. A rate limited connection stops reading until it's resumed.
+// Reading stops at the first completed packet, with keep-alive the rest waits in the
+// socket until its echoes are through.
+result_t connection_receive(aesdsocket_t* aesdsocket, event_loop_t* event_loop, connection_t* connection) {
+    while (connection->throttled_ns == 0) {
+        struct iovec received[RECEIVE_CHAIN_MAX];
+        size_t bytes_received = 0;
+        ssize_t received_count = receive_chain_read(&event_loop->receive_chain, connection->peer_fd,
+            received, &bytes_received);
+        if (received_count < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return(SUCCESS);
+            } else if (errno == EINTR) {
+                continue;
+            } else if ((connection->state == CONNECTION_FOLLOWING || aesdsocket->config.keep_alive)
+                    && peer_gone(errno)) {
+                connection->state = CONNECTION_CLOSED;
+                return(SUCCESS);
+            }
+            perror("recv failed");
+            return(FAILURE);
+        } else if (received_count == 0) {
+            AESD_LOG(LOG_DEBUG, "(%d) end of receive data", connection->id);
+            connection->state = CONNECTION_CLOSED;
+            return(SUCCESS);
+        }
+        log_payload(connection->id, connection->peer_fd, received[0].iov_base, bytes_received);
+        metrics_add(&metrics_thread()->bytes_received, bytes_received);
+
+        uint64_t seek_record;
+        uint64_t seek_offset;
+        if (connection->state == CONNECTION_RECEIVING && connection->staging.length == 0
+                && parse_seek_command(received, received_count, bytes_received, &seek_record, &seek_offset)) {
+            if (history_seek(&aesdsocket->history, seek_record, seek_offset, &connection->cursor) == FAILURE) {
+                AESD_LOG(LOG_WARNING, "(%d) invalid seek to record %ju offset %ju", connection->id,
+                    (uintmax_t) seek_record, (uintmax_t) seek_offset);
+                connection->state = CONNECTION_CLOSED;
+                return(SUCCESS);
+            }
+            connection->state = CONNECTION_SENDING;
+            connection->send_end = __atomic_load_n(&aesdsocket->history.length, __ATOMIC_ACQUIRE);
+            connection->echo_start_ns = metrics_now_ns();
+            return(SUCCESS);
+        }
+
+        // A following connection just keeps appending, its data reaches it with the rest.
+        bool following = connection->state == CONNECTION_FOLLOWING;
+        size_t max_record = aesdsocket->config.max_record;
+        if (receive_records(&aesdsocket->history, &connection->staging, following ? NULL : &connection->pipeline,
+                max_record, received, received_count, bytes_received) == FAILURE) {
+            if (errno == EMSGSIZE) {
+                record_rejected(connection->id, max_record);
+                connection->state = CONNECTION_CLOSED;
+                return(SUCCESS);
+            }
+            return(FAILURE);
+        }
+        uint64_t wait_ns = rate_limit_received(&aesdsocket->rate_limiter, connection->rate_bucket, received,
+            received_count, bytes_received);
+        if (wait_ns > 0) {
+            connection->throttled_ns = metrics_now_ns() + wait_ns;
+            LIST_INSERT_HEAD(&event_loop->throttled, connection, throttled_entries);
+        }
+        if (following) {
+            continue;
+        }
+        if (connection_next_packet(aesdsocket, event_loop, connection)) {
+            return(SUCCESS);
+        }
+    }
+    return(SUCCESS);
+}
+
+// Tail mode: after its echo a connection stays open and streams whatever gets appended.
+void start_following(aesdsocket_t* aesdsocket, event_loop_t* event_loop, connection_t* connection) {
+    LIST_INSERT_HEAD(&event_loop->following, connection, following_entries);
+    connection->following = true;
+    connection->state = CONNECTION_FOLLOWING;
+    event_loop_watch(aesdsocket, event_loop);
+    AESD_LOG(LOG_DEBUG, "(%d) following", connection->id);
+}
+
+// Send the history snapshot back to the peer, resuming wherever the last call left off
+// when the socket buffer filled up. Keep-alive connections go on with the echoes of
+// packets they pipelined.
+result_t connection_send(aesdsocket_t* aesdsocket, event_loop_t* event_loop, connection_t* connection) {
+    while (connection->state == CONNECTION_SENDING) {
+        while (connection->cursor.offset < connection->send_end) {
+            ssize_t sent_amount = history_send(&aesdsocket->history, connection->peer_fd,
+                &connection->cursor, connection->send_end);
+            if (sent_amount == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return(SUCCESS);
+                } else if (errno == EINTR) {
+                    continue;
+                } else if (aesdsocket->config.keep_alive && peer_gone(errno)) {
+                    connection->state = CONNECTION_CLOSED;
+                    return(SUCCESS);
+                }
+                perror("send failed");
+                return(FAILURE);
+            }
+            metrics_add(&metrics_thread()->bytes_sent, sent_amount);
+        }
+        metrics_observe(&metrics_thread()->echo_latency, metrics_now_ns() - connection->echo_start_ns);
+        if (aesdsocket->config.keep_alive) {
+            // Draining, a connection between packets is done.
+            connection->echoed = true;
+            if (!connection_next_packet(aesdsocket, event_loop, connection)) {
+                connection->state = event_loop->draining && connection->staging.length == 0
+                    ? CONNECTION_CLOSED : CONNECTION_RECEIVING;
+            }
+        } else if (aesdsocket->config.tail && !event_loop->draining) {
+            start_following(aesdsocket, event_loop, connection);
+        } else {
+            connection->state = CONNECTION_CLOSED;
+        }
+    }
+    return(SUCCESS);
+}
+
+// Stream everything published since the last send. Stops at EAGAIN, the edge triggered
+// EPOLLOUT or the next watcher wakeup picks up from the cursor.
+result_t connection_follow(aesdsocket_t* aesdsocket, connection_t* connection) {
+    size_t end = __atomic_load_n(&aesdsocket->history.length, __ATOMIC_ACQUIRE);
+    while (connection->cursor.offset < end) {
+        ssize_t sent_amount = history_send(&aesdsocket->history, connection->peer_fd, &connection->cursor, end);
+        if (sent_amount == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return(SUCCESS);
+            } else if (errno == EINTR) {
+                continue;
+            } else if (!peer_gone(errno)) {
+                perror("send failed");
+            }
+            return(FAILURE);
+        }
+        metrics_add(&metrics_thread()->bytes_sent, sent_amount);
+    }
+    return(SUCCESS);
+}
+
+void close_connection(aesdsocket_t* aesdsocket, event_loop_t* event_loop, connection_t* connection) {
+    if (connection->following) {
+        LIST_REMOVE(connection, following_entries);
+        event_loop_watch(aesdsocket, event_loop);
+    } else if (connection->state == CONNECTION_SYNCING) {
+        LIST_REMOVE(connection, syncing_entries);
+        event_loop_watch(aesdsocket, event_loop);
+    }
+    if (aesdsocket->config.keep_alive) {
+        TAILQ_REMOVE(&event_loop->idle, connection, idle_entries);
+    }
+    if (connection->throttled_ns != 0) {
+        LIST_REMOVE(connection, throttled_entries);
+    }
+    close(connection->peer_fd);
+    staging_free(&connection->staging);
+    rate_limit_release(connection->rate_bucket);
+    event_loop->connections -= 1;
+    metrics_add(&metrics_thread()->connections_closed, 1);
+    int connections_count = __atomic_sub_fetch(&aesdsocket->connections_count, 1, __ATOMIC_RELAXED);
+    AESD_LOG(LOG_DEBUG, "removed connection %d. connections_count: %d", connection->id, connections_count);
+    object_pool_put(&event_loop->connection_pool, connection);
+}
+
+// Keep-alive: move the connection to the back of the idle list.
+void touch_connection(event_loop_t* event_loop, connection_t* connection) {
+    connection->active_ns = metrics_now_ns();
+    TAILQ_REMOVE(&event_loop->idle, connection, idle_entries);
+    TAILQ_INSERT_TAIL(&event_loop->idle, connection, idle_entries);
+}
+
+void process_connection(aesdsocket_t* aesdsocket, event_loop_t* event_loop, connection_t* connection) {
+    result_t result = SUCCESS;
+    if (aesdsocket->config.keep_alive) {
+        touch_connection(event_loop, connection);
+    }
+    while (true) {
+        if (connection->state == CONNECTION_RECEIVING || connection->state == CONNECTION_FOLLOWING) {
+            result = connection_receive(aesdsocket, event_loop, connection);
+        }
+        // Fall through on the same wakeup, the socket is usually writable right away.
+        if (result == SUCCESS && connection->state == CONNECTION_SENDING) {
+            result = connection_send(aesdsocket, event_loop, connection);
+            // A keep-alive echo is through, edge triggered epoll won't report again what the
+            // peer already pipelined behind it.
+            if (result == SUCCESS && connection->state == CONNECTION_RECEIVING) {
+                continue;
+            }
+        }
+        break;
+    }
+    if (result == SUCCESS && connection->state == CONNECTION_FOLLOWING) {
+        result = connection_follow(aesdsocket, connection);
+    }
+    if (result == FAILURE || connection->state == CONNECTION_CLOSED) {
+        close_connection(aesdsocket, event_loop, connection);
+    }
+}
+
+void accept_connections(aesdsocket_t* aesdsocket, event_loop_t* event_loop) {
+    while (true) {
+        struct sockaddr_storage peer_address;
+        socklen_t peer_address_length = sizeof(peer_address);
+        int peer_fd = accept4(event_loop->server_fd, (struct sockaddr*) &peer_address, &peer_address_length,
+            SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (peer_fd == -1) {
+            // EINVAL means cleanup shut the listening socket down underneath us.
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != EINVAL) {
+                metrics_add(&metrics_thread()->accept_errors, 1);
+                perror("accept failed");
+                AESD_LOG(LOG_ERR, "accept failed: %s", strerror(errno));
+            }
+            return;
+        }
+
+        connection_t* connection = object_pool_get(&event_loop->connection_pool);
+        if (connection == NULL) {
+            close(peer_fd);
+            continue;
+        }
+        connection->id = __atomic_fetch_add(&aesdsocket->metrics.total_connections, 1, __ATOMIC_RELAXED);
+        connection->peer_fd = peer_fd;
+        connection->state = CONNECTION_RECEIVING;
+        connection->staging = (staging_t) { 0 };
+        connection->following = false;
+        connection->pipeline = (pipeline_t) { .whole = !aesdsocket->config.keep_alive };
+        connection->echoed = false;
+        connection->throttled_ns = 0;
+
+        // Edge triggered, the handlers always drain until EAGAIN.
+        struct epoll_event event = { 0 };
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = connection;
+        if (epoll_ctl(event_loop->epoll_fd, EPOLL_CTL_ADD, peer_fd, &event) != 0) {
+            perror("epoll_ctl add peer");
+            close(peer_fd);
+            object_pool_put(&event_loop->connection_pool, connection);
+            continue;
+        }
+        connection->rate_bucket = rate_limit_acquire(&aesdsocket->rate_limiter, (struct sockaddr*) &peer_address);
+
+        if (aesdsocket->config.keep_alive) {
+            connection->active_ns = metrics_now_ns();
+            TAILQ_INSERT_TAIL(&event_loop->idle, connection, idle_entries);
+        }
+        metrics_add(&metrics_thread()->connections_opened, 1);
+        event_loop->connections += 1;
+        int connections_count = __atomic_add_fetch(&aesdsocket->connections_count, 1, __ATOMIC_RELAXED);
+        AESD_LOG(LOG_DEBUG, "loop %d new connection %d. connections_count: %d",
+            event_loop->index, connection->id, connections_count);
+    }
+}
+
+// Registered for shutdown_fd, to tell it apart from the listener (NULL) and connections.
+static int shutdown_event_tag;
+
+// Wake up every following connection of the loop after the history grew.
+void follow_connections(aesdsocket_t* aesdsocket, event_loop_t* event_loop) {
+    history_watcher_rearm(event_loop->watcher);
+    connection_t* connection = NULL;
+    connection_t* temp = NULL;
+    LIST_FOREACH_SAFE(connection, &event_loop->following, following_entries, temp) {
+        if (connection_follow(aesdsocket, connection) == FAILURE) {
+            close_connection(aesdsocket, event_loop, connection);
+        }
+    }
+}
+
+// Echo everything that became durable since the last wakeup, or give up on all of it
+// once syncing failed.
+void sync_connections(aesdsocket_t* aesdsocket, event_loop_t* event_loop) {
+    connection_t* connection = NULL;
+    connection_t* temp = NULL;
+    LIST_FOREACH_SAFE(connection, &event_loop->syncing, syncing_entries, temp) {
+        if (history_durable(&aesdsocket->history, connection->send_end)) {
+            stop_syncing(aesdsocket, event_loop, connection);
+            process_connection(aesdsocket, event_loop, connection);
+        } else if (__atomic_load_n(&aesdsocket->history.sync_failed, __ATOMIC_SEQ_CST)) {
+            close_connection(aesdsocket, event_loop, connection);
+        }
+    }
+}
+
+// Keep-alive: close the connections that were quiet for the idle timeout. Returns how
+// long epoll_wait may block until the next one is due, -1 for as long as it takes.
+int expire_idle_connections(aesdsocket_t* aesdsocket, event_loop_t* event_loop) {
+    if (!aesdsocket->config.keep_alive || aesdsocket->config.idle_timeout == 0) {
+        return -1;
+    }
+    uint64_t timeout_ns = (uint64_t) aesdsocket->config.idle_timeout * 1000000000ull;
+    uint64_t now_ns = metrics_now_ns();
+    connection_t* connection = NULL;
+    while ((connection = TAILQ_FIRST(&event_loop->idle)) != NULL) {
+        uint64_t due_ns = connection->active_ns + timeout_ns;
+        if (due_ns > now_ns) {
+            return (int) ((due_ns - now_ns + 999999) / 1000000);
+        }
+        // Held back by its rate limit rather than quiet.
+        if (connection->throttled_ns != 0) {
+            touch_connection(event_loop, connection);
+            continue;
+        }
+        AESD_LOG(LOG_DEBUG, "(%d) idle, closing", connection->id);
+        close_connection(aesdsocket, event_loop, connection);
+    }
+    return -1;
+}
+
+// Rate limiting: go on reading from the connections whose wait is over. Returns how long
+// epoll_wait may block until the next one is due, -1 for as long as it takes.
+int resume_throttled_connections(aesdsocket_t* aesdsocket, event_loop_t* event_loop) {
+    uint64_t now_ns = metrics_now_ns();
+    connection_t* connection = NULL;
+    connection_t* temp = NULL;
+    LIST_FOREACH_SAFE(connection, &event_loop->throttled, throttled_entries, temp) {
+        if (connection->throttled_ns <= now_ns) {
+            LIST_REMOVE(connection, throttled_entries);
+            connection->throttled_ns = 0;
+            // Edge triggered, what the peer sent meanwhile won't be reported again.
+            process_connection(aesdsocket, event_loop, connection);
+        }
+    }
+    // Resumed connections may have gone over again.
+    uint64_t next_ns = UINT64_MAX;
+    LIST_FOREACH(connection, &event_loop->throttled, throttled_entries) {
+        next_ns = connection->throttled_ns < next_ns ? connection->throttled_ns : next_ns;
+    }
+    return next_ns == UINT64_MAX ? -1 : (int) ((next_ns - now_ns + 999999) / 1000000);
+}
+
+// Take what is left in the backlog and stop listening. The loop keeps serving its open
+// connections and exits after the last one closes. Following connections have no request
+// in flight, they are closed right away, so are keep-alive connections between packets
+// once they got at least one echo.
+void start_draining(aesdsocket_t* aesdsocket, event_loop_t* event_loop) {
+    connection_t* connection = NULL;
+    connection_t* temp = NULL;
+    LIST_FOREACH_SAFE(connection, &event_loop->following, following_entries, temp) {
+        close_connection(aesdsocket, event_loop, connection);
+    }
+    if (aesdsocket->config.keep_alive) {
+        TAILQ_FOREACH_SAFE(connection, &event_loop->idle, idle_entries, temp) {
+            if (connection->echoed && connection->state == CONNECTION_RECEIVING && connection->staging.length == 0) {
+                close_connection(aesdsocket, event_loop, connection);
+            }
+        }
+    }
+    accept_connections(aesdsocket, event_loop);
+    epoll_ctl(event_loop->epoll_fd, EPOLL_CTL_DEL, event_loop->server_fd, NULL);
+    epoll_ctl(event_loop->epoll_fd, EPOLL_CTL_DEL, aesdsocket->shutdown_fd, NULL);
+    if (event_loop->server_fd != aesdsocket->server_fd) {
+        close(event_loop->server_fd);
+    }
+    event_loop->draining = true;
+    stop_accepting(aesdsocket);
+    AESD_LOG(LOG_DEBUG, "loop %d draining %d connections", event_loop->index, event_loop->connections);
+}
+
+void* manage_event_loop_thread(void* arg) {
+    event_loop_t* event_loop = (event_loop_t*) arg;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    AESD_LOG(LOG_DEBUG, "manage_event_loop_thread() %d", event_loop->index);
+
+    while (!event_loop->draining || event_loop->connections > 0) {
+        int timeout_ms = expire_idle_connections(&g_aesdsocket, event_loop);
+        int throttled_ms = resume_throttled_connections(&g_aesdsocket, event_loop);
+        if (throttled_ms != -1 && (timeout_ms == -1 || throttled_ms < timeout_ms)) {
+            timeout_ms = throttled_ms;
+        }
+        if (event_loop->draining && event_loop->connections == 0) {
+            break;
+        }
+        int event_count = epoll_wait(event_loop->epoll_fd, events, EPOLL_MAX_EVENTS, timeout_ms);
+        if (event_count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            return NULL;
+        }
+        // Following connections may get closed by these two, so they run after the batch
+        // instead of leaving later events in it pointing at freed connections.
+        bool follow = false;
+        bool drain = false;
+        for (int i = 0; i < event_count; i++) {
+            // The listening socket is the only registration without a connection.
+            if (events[i].data.ptr == NULL) {
+                if (!event_loop->draining) {
+                    accept_connections(&g_aesdsocket, event_loop);
+                }
+            } else if (events[i].data.ptr == &shutdown_event_tag) {
+                drain = true;
+            } else if (events[i].data.ptr == event_loop->watcher) {
+                follow = true;
+            } else {
+                process_connection(&g_aesdsocket, event_loop, (connection_t*) events[i].data.ptr);
+            }
+        }
+        if (follow) {
+            follow_connections(&g_aesdsocket, event_loop);
+            sync_connections(&g_aesdsocket, event_loop);
+        }
+        if (drain) {
+            start_draining(&g_aesdsocket, event_loop);
+        }
+    }
+    AESD_LOG(LOG_DEBUG, "loop %d drained", event_loop->index);
+    return NULL;
+}
+
+// Pin a thread to the index-th CPU this process may run on, wrapping around.
+void pin_thread(pthread_t thread, int index) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        perror("sched_getaffinity");
+        return;
+    }
+    int target = index % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && target-- == 0) {
+            cpu_set_t pinned;
+            CPU_ZERO(&pinned);
+            CPU_SET(cpu, &pinned);
+            int result = pthread_setaffinity_np(thread, sizeof(pinned), &pinned);
+            if (result != 0) {
+                errno = result;
+                perror("pthread_setaffinity_np");
+            }
+            syslog(LOG_DEBUG, "loop %d pinned to cpu %d", index, cpu);
+            return;
+        }
+    }
+}
+
+// By default every loop registers the shared listening socket with EPOLLEXCLUSIVE so a
+// new connection wakes a single loop, which then owns that connection for its lifetime.
+// With reuseport each loop instead accepts from its own listener and runs on its own
+// CPU, so accepting scales with the loops rather than funneling through one socket.
+result_t run_event_loop_server(aesdsocket_t* aesdsocket) {
+    raise_open_file_limit();
+
+    int loop_count = aesdsocket->config.threads;
+    aesdsocket->acceptors = loop_count;
+    aesdsocket->event_loops = calloc(loop_count, sizeof(event_loop_t));
+    if (aesdsocket->event_loops == NULL) {
+        perror("calloc event_loops");
+        return(FAILURE);
+    }
+
+    for (int i = 0; i < loop_count; i++) {
+        event_loop_t* event_loop = &aesdsocket->event_loops[i];
+        event_loop->index = i;
+        object_pool_init(&event_loop->connection_pool, sizeof(connection_t), false);
+        if (receive_chain_init(&event_loop->receive_chain, aesdsocket->config.receive_buffers,
+                aesdsocket->config.receive_buffer_size) == FAILURE) {
+            return(FAILURE);
+        }
+        event_loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (event_loop->epoll_fd == -1) {
+            perror("epoll_create1");
+            return(FAILURE);
+        }
+
+        // The first loop keeps the listener main opened.
+        event_loop->server_fd = aesdsocket->server_fd;
+        if (aesdsocket->config.reuseport && i > 0
+                && open_listener(aesdsocket->address, &aesdsocket->config, &event_loop->server_fd) == FAILURE) {
+            return(FAILURE);
+        }
+        if (set_non_blocking(event_loop->server_fd) == FAILURE) {
+            return(FAILURE);
+        }
+
+        struct epoll_event event = { 0 };
+        event.events = aesdsocket->config.reuseport ? EPOLLIN : EPOLLIN | EPOLLEXCLUSIVE;
+        event.data.ptr = NULL;
+        if (epoll_ctl(event_loop->epoll_fd, EPOLL_CTL_ADD, event_loop->server_fd, &event) != 0) {
+            perror("epoll_ctl add server_fd");
+            return(FAILURE);
+        }
+        event.events = EPOLLIN;
+        event.data.ptr = &shutdown_event_tag;
+        if (epoll_ctl(event_loop->epoll_fd, EPOLL_CTL_ADD, aesdsocket->shutdown_fd, &event) != 0) {
+            perror("epoll_ctl add shutdown_fd");
+            return(FAILURE);
+        }
+
+        LIST_INIT(&event_loop->following);
+        LIST_INIT(&event_loop->syncing);
+        TAILQ_INIT(&event_loop->idle);
+        LIST_INIT(&event_loop->throttled);
+        event_loop->watching = false;
+        if (aesdsocket->config.tail || aesdsocket->config.sync != HISTORY_SYNC_NONE) {
+            event_loop->watcher = history_add_watcher(&aesdsocket->history);
+            if (event_loop->watcher == NULL) {
+                return(FAILURE);
+            }
+            event.events = EPOLLIN;
+            event.data.ptr = event_loop->watcher;
+            if (epoll_ctl(event_loop->epoll_fd, EPOLL_CTL_ADD, event_loop->watcher->event_fd, &event) != 0) {
+                perror("epoll_ctl add watcher");
+                return(FAILURE);
+            }
+        }
+
+        if (pthread_create(&event_loop->thread_id, NULL, manage_event_loop_thread, event_loop) != 0) {
+            perror("pthread_create");
+            return(FAILURE);
+        }
+        if (aesdsocket->config.reuseport) {
+            pin_thread(event_loop->thread_id, i);
+        }
+    }
+    syslog(LOG_INFO, "started %d event loops%s, listen backlog %d", loop_count,
+        aesdsocket->config.reuseport ? " with SO_REUSEPORT listeners" : "", aesdsocket->config.listen_backlog);
+
+    for (int i = 0; i < loop_count; i++) {
+        pthread_join(aesdsocket->event_loops[i].thread_id, NULL);
+    }
+    syslog(LOG_INFO, "all event loops drained");
+    return SUCCESS;
+}
+
+// MARK: io_uring
+
+// No liburing on the targets, the three syscalls are all it takes.
+int uring_setup(unsigned entries, struct io_uring_params* params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+int uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int uring_register(int ring_fd, unsigned opcode, const void* arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+result_t uring_init(uring_t* ring, unsigned entries) {
+    // Task work only runs when the loop enters the kernel anyway, instead of interrupting it.
+    struct io_uring_params params = { 0 };
+    params.flags = IORING_SETUP_COOP_TASKRUN;
+    ring->ring_fd = uring_setup(entries, &params);
+    if (ring->ring_fd == -1 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        ring->ring_fd = uring_setup(entries, &params);
+    }
+    if (ring->ring_fd == -1) {
+        return(FAILURE);
+    }
+    // Kernels without the single mapping also lack the registrations used below.
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        errno = EOPNOTSUPP;
+        return(FAILURE);
+    }
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_map_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_map = mmap(NULL, ring->ring_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->ring_fd, IORING_OFF_SQ_RING);
+    if (ring->ring_map == MAP_FAILED) {
+        return(FAILURE);
+    }
+    ring->sqes_map_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->ring_map, ring->ring_map_size);
+        return(FAILURE);
+    }
+
+    char* map = ring->ring_map;
+    ring->sq_head = (unsigned*) (map + params.sq_off.head);
+    ring->sq_tail = (unsigned*) (map + params.sq_off.tail);
+    ring->sq_array = (unsigned*) (map + params.sq_off.array);
+    ring->sq_mask = *(unsigned*) (map + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_pending_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned*) (map + params.cq_off.head);
+    ring->cq_tail = (unsigned*) (map + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*) (map + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (map + params.cq_off.cqes);
+    return SUCCESS;
+}
+
+void uring_free(uring_t* ring) {
+    if (ring->ring_fd == -1) {
+        return;
+    }
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_map_size);
+    }
+    if (ring->ring_map != NULL && ring->ring_map != MAP_FAILED) {
+        munmap(ring->ring_map, ring->ring_map_size);
+    }
+    close(ring->ring_fd);
+    ring->ring_fd = -1;
+}
+
+// Hand everything queued since the last call to the kernel and, with wait, block until at
+// least one completion is there. One syscall per loop iteration does both.
+int uring_submit(uring_t* ring, unsigned wait) {
+    __atomic_store_n(ring->sq_tail, ring->sq_pending_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = ring->sq_pending_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    return uring_enter(ring->ring_fd, to_submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+}
+
+// Make room for count sqes, submitting what's queued if needed. Linked sqes have to go
+// to the kernel in the same submission.
+void uring_reserve(uring_t* ring, unsigned count) {
+    while (ring->sq_entries - (ring->sq_pending_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) < count) {
+        if (uring_submit(ring, 0) == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter");
+        }
+    }
+}
+
+// Next free sqe, cleared. Submits first when the queue is full.
+struct io_uring_sqe* uring_get_sqe(uring_t* ring) {
+    uring_reserve(ring, 1);
+    unsigned index = ring->sq_pending_tail & ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_pending_tail += 1;
+    return sqe;
+}
+
+// Queue an op on a connection's socket, or a ring level one with a NULL connection.
+struct io_uring_sqe* uring_prep(uring_loop_t* loop, uring_op_t op, uring_connection_t* connection, uint8_t opcode) {
+    struct io_uring_sqe* sqe = uring_get_sqe(&loop->ring);
+    sqe->opcode = opcode;
+    sqe->user_data = (uint64_t) (uintptr_t) connection | op;
+    if (connection != NULL) {
+        sqe->fd = connection->fd;
+        if (connection->fixed) {
+            sqe->flags |= IOSQE_FIXED_FILE;
+        }
+        connection->inflight += 1;
+    }
+    return sqe;
+}
+
+// Hand a receive buffer back to the kernel.
+void uring_recycle_buffer(uring_loop_t* loop, unsigned short buffer_id) {
+    struct io_uring_buf* buffer = &loop->recv_ring->bufs[loop->recv_tail & (URING_RECV_BUFFERS - 1)];
+    buffer->addr = (uint64_t) (uintptr_t) (loop->recv_buffers + buffer_id * loop->recv_buffer_size);
+    buffer->len = loop->recv_buffer_size;
+    buffer->bid = buffer_id;
+    loop->recv_tail += 1;
+    __atomic_store_n(&loop->recv_ring->tail, loop->recv_tail, __ATOMIC_RELEASE);
+}
+
+// Accept straight into a free fixed file slot, so the socket never takes up a descriptor
+// and later ops skip the file table lookup.
+void uring_accept(aesdsocket_t* aesdsocket, uring_loop_t* loop) {
+    struct io_uring_sqe* sqe = uring_prep(loop, URING_OP_ACCEPT, NULL, IORING_OP_ACCEPT);
+    sqe->fd = aesdsocket->server_fd;
+    loop->accept_address_length = sizeof(loop->accept_address);
+    sqe->addr = (uint64_t) (uintptr_t) &loop->accept_address;
+    sqe->addr2 = (uint64_t) (uintptr_t) &loop->accept_address_length;
+    if (loop->direct_accept) {
+        sqe->file_index = IORING_FILE_INDEX_ALLOC;
+    } else {
+        sqe->accept_flags = SOCK_CLOEXEC;
+    }
+    loop->accepting = true;
+}
+
+// The kernel picks a provided buffer once data arrives, idle connections don't pin one.
+// Keep-alive receives carry a linked timeout, when it fires the receive comes back
+// cancelled. A rate limited connection's receive sits behind a timeout for its wait.
+void uring_receive(aesdsocket_t* aesdsocket, uring_loop_t* loop, uring_connection_t* connection) {
+    bool timeout = aesdsocket->config.keep_alive && aesdsocket->config.idle_timeout > 0;
+    bool throttled = connection->throttle.tv_sec != 0 || connection->throttle.tv_nsec != 0;
+    uring_reserve(&loop->ring, 1 + timeout + throttled);
+    struct io_uring_sqe* sqe;
+    if (throttled) {
+        sqe = uring_prep(loop, URING_OP_NONE, NULL, IORING_OP_TIMEOUT);
+        sqe->addr = (uint64_t) (uintptr_t) &connection->throttle;
+        sqe->len = 1;
+        sqe->timeout_flags = IORING_TIMEOUT_ETIME_SUCCESS;
+        sqe->flags |= IOSQE_IO_LINK;
+    }
+    sqe = uring_prep(loop, URING_OP_RECV, connection, IORING_OP_RECV);
+    sqe->len = loop->recv_buffer_size;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    if (timeout) {
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe = uring_prep(loop, URING_OP_NONE, NULL, IORING_OP_LINK_TIMEOUT);
+        sqe->addr = (uint64_t) (uintptr_t) &loop->idle_timeout;
+        sqe->len = 1;
+    }
+}
+
+// Closes once nothing is in flight anymore, the last completion calls this again.
+void uring_close(uring_loop_t* loop, uring_connection_t* connection) {
+    connection->closing = true;
+    if (connection->inflight > 0 || connection->state == CONNECTION_CLOSED) {
+        return;
+    }
+    connection->state = CONNECTION_CLOSED;
+    struct io_uring_sqe* sqe = uring_prep(loop, URING_OP_CLOSE, connection, IORING_OP_CLOSE);
+    if (connection->fixed) {
+        sqe->fd = 0;
+        sqe->flags &= ~IOSQE_FIXED_FILE;
+        sqe->file_index = connection->fd + 1;
+    }
+}
+
+// Queue the next piece of the echo. The memory store sends straight out of its segments.
+// The file store reads into a registered buffer with a send linked behind it, so each
+// piece is still a single submission.
+void uring_send_next(aesdsocket_t* aesdsocket, uring_loop_t* loop, uring_connection_t* connection) {
+    history_t* history = &aesdsocket->history;
+    // Readers that fell behind retention skip what it dropped.
+    size_t start = __atomic_load_n(&history->start, __ATOMIC_ACQUIRE);
+    if (connection->cursor.offset < start) {
+        connection->cursor.offset = start;
+    }
+    if (connection->cursor.offset >= connection->send_end) {
+        metrics_observe(&metrics_thread()->echo_latency, metrics_now_ns() - connection->echo_start_ns);
+        if (aesdsocket->config.keep_alive) {
+            uring_echoed(aesdsocket, loop, connection);
+        } else {
+            uring_close(loop, connection);
+        }
+        return;
+    }
+
+    // Pieces with more of the echo behind them carry MSG_MORE, so they leave in full segments.
+    size_t remaining = connection->send_end - connection->cursor.offset;
+    size_t span = remaining;
+    if (history->store == HISTORY_STORE_MEMORY) {
+        const char* data = history_segment_span(history, &connection->cursor, &span);
+        struct io_uring_sqe* sqe = uring_prep(loop, URING_OP_SEND, connection, IORING_OP_SEND);
+        sqe->addr = (uint64_t) (uintptr_t) data;
+        sqe->len = span;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (span < remaining ? MSG_MORE : 0);
+        return;
+    }
+
+    if (loop->free_read_count == 0) {
+        STAILQ_INSERT_TAIL(&loop->waiting, connection, waiting_entries);
+        return;
+    }
+    history_file_t* file = NULL;
+    int fd = history->data_fd;
+    size_t file_offset = connection->cursor.offset;
+    if (history->segment_size != 0) {
+        file = history_file_acquire(history, connection->cursor.offset);
+        if (file == NULL) {
+            // Dropped since start was read, the next round skips past it.
+            uring_send_next(aesdsocket, loop, connection);
+            return;
+        }
+        fd = file->fd;
+        file_offset = connection->cursor.offset % history->segment_size;
+        if (span > history->segment_size - file_offset) {
+            span = history->segment_size - file_offset;
+        }
+    }
+    if (span > URING_READ_BUFFER_SIZE) {
+        span = URING_READ_BUFFER_SIZE;
+    }
+    int buffer = loop->free_reads[--loop->free_read_count];
+    char* data = loop->read_buffers + (size_t) buffer * URING_READ_BUFFER_SIZE;
+
+    // Bytes below send_end are already written. A short read fails the link and cancels
+    // the send.
+    uring_reserve(&loop->ring, 2);
+    struct io_uring_sqe* sqe = uring_prep(loop, URING_OP_READ, connection, IORING_OP_READ_FIXED);
+    sqe->fd = fd;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->addr = (uint64_t) (uintptr_t) data;
+    sqe->len = span;
+    sqe->off = file_offset;
+    sqe->buf_index = buffer;
+    sqe = uring_prep(loop, URING_OP_SEND, connection, IORING_OP_SEND);
+    sqe->addr = (uint64_t) (uintptr_t) data;
+    sqe->len = span;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (span < remaining ? MSG_MORE : 0);
+    connection->read_buffer = buffer;
+    connection->read_length = span;
+    connection->read_file = file;
+}
+
+void uring_add_connection(aesdsocket_t* aesdsocket, uring_loop_t* loop, int fd, bool fixed,
+        const struct sockaddr* peer) {
+    uring_connection_t* connection = object_pool_get(&loop->connection_pool);
+    if (connection == NULL) {
+        if (fixed) {
+            struct io_uring_sqe* sqe = uring_prep(loop, URING_OP_CLOSE, NULL, IORING_OP_CLOSE);
+            sqe->file_index = fd + 1;
+        } else {
+            close(fd);
+        }
+        return;
+    }
+    connection->id = __atomic_fetch_add(&aesdsocket->metrics.total_connections, 1, __ATOMIC_RELAXED);
+    connection->fd = fd;
+    connection->fixed = fixed;
+    connection->state = CONNECTION_RECEIVING;
+    connection->staging = (staging_t) { 0 };
+    connection->inflight = 0;
+    connection->closing = false;
+    connection->read_buffer = -1;
+    connection->read_file = NULL;
+    connection->pipeline = (pipeline_t) { .whole = !aesdsocket->config.keep_alive };
+    connection->echoed = false;
+    connection->idle = false;
+    connection->rate_bucket = rate_limit_acquire(&aesdsocket->rate_limiter, peer);
+    connection->throttle = (struct __kernel_timespec) { 0 };
+    uring_receive(aesdsocket, loop, connection);
+
+    metrics_add(&metrics_thread()->connections_opened, 1);
+    loop->connections += 1;
+    int connections_count = __atomic_add_fetch(&aesdsocket->connections_count, 1, __ATOMIC_RELAXED);
+    AESD_LOG(LOG_DEBUG, "ring %d new connection %d. connections_count: %d",
+        loop->index, connection->id, connections_count);
+}
+
+void uring_accepted(aesdsocket_t* aesdsocket, uring_loop_t* loop, int result) {
+    loop->accepting = false;
+    if (result >= 0) {
+        uring_add_connection(aesdsocket, loop, result, loop->direct_accept,
+            (struct sockaddr*) &loop->accept_address);
+    } else if (result == -ENFILE && loop->direct_accept) {
+        // Every fixed slot is taken, plain descriptors until a connection closes.
+        loop->direct_accept = false;
+    } else if (result == -EINVAL) {
+        // Cleanup shut the listening socket down underneath us.
+        loop->accept_paused = true;
+    } else if (result != -ECANCELED && result != -EINTR && result != -EAGAIN) {
+        metrics_add(&metrics_thread()->accept_errors, 1);
+        AESD_LOG(LOG_ERR, "accept failed: %s", strerror(-result));
+        loop->accept_paused = result == -EMFILE || result == -ENFILE || result == -ENOMEM;
+    }
+
+    if (!loop->draining) {
+        if (!loop->accept_paused) {
+            uring_accept(aesdsocket, loop);
+        }
+        return;
+    }
+    // Take what is left in the backlog, like the epoll loops do, and stop listening.
+    while (true) {
+        struct sockaddr_storage peer_address;
+        socklen_t peer_address_length = sizeof(peer_address);
+        int peer_fd = accept4(aesdsocket->server_fd, (struct sockaddr*) &peer_address, &peer_address_length,
+            SOCK_CLOEXEC);
+        if (peer_fd == -1) {
+            break;
+        }
+        uring_add_connection(aesdsocket, loop, peer_fd, false, (struct sockaddr*) &peer_address);
+    }
+    stop_accepting(aesdsocket);
+    AESD_LOG(LOG_DEBUG, "ring %d draining %d connections", loop->index, loop->connections);
+}
+
+// Start echoing the next packet the connection completed, if there is one.
+bool uring_next_packet(aesdsocket_t* aesdsocket, uring_loop_t* loop, uring_connection_t* connection) {
+    size_t send_end = 0;
+    if (!pipeline_next(&aesdsocket->history, &connection->pipeline, &send_end)) {
+        return false;
+    }
+    connection->state = CONNECTION_SENDING;
+    connection->send_end = send_end;
+    connection->echo_start_ns = metrics_now_ns();
+    history_cursor_init(&connection->cursor);
+    uring_send_next(aesdsocket, loop, connection);
+    return true;
+}
+
+// Keep-alive: an echo is through, go on with the next pipelined packet or receive again.
+// Between packets the connection is idle, draining closes it.
+void uring_echoed(aesdsocket_t* aesdsocket, uring_loop_t* loop, uring_connection_t* connection) {
+    connection->echoed = true;
+    if (uring_next_packet(aesdsocket, loop, connection)) {
+        return;
+    }
+    connection->state = CONNECTION_RECEIVING;
+    if (connection->staging.length == 0) {
+        if (loop->draining) {
+            uring_close(loop, connection);
+            return;
+        }
+        LIST_INSERT_HEAD(&loop->idle, connection, idle_entries);
+        connection->idle = true;
+    }
+    uring_receive(aesdsocket, loop, connection);
+}
+
+// Append the records that arrived to the history and stage the rest. Once the packet's
+// newline arrives, the echo covers the history up to and including it.
+void uring_received(aesdsocket_t* aesdsocket, uring_loop_t* loop, uring_connection_t* connection,
+        int result, uint32_t flags) {
+    if (connection->idle) {
+        LIST_REMOVE(connection, idle_entries);
+        connection->idle = false;
+    }
+    // The kernel read the throttle delay when the receive was submitted.
+    connection->throttle = (struct __kernel_timespec) { 0 };
+    if (result == -ENOBUFS) {
+        // Every provided buffer was taken in this batch, they're back by now.
+        uring_receive(aesdsocket, loop, connection);
+        return;
+    } else if (result < 0) {
+        // Cancelled by the idle timeout or draining.
+        if (result != -ECANCELED && !peer_gone(-result)) {
+            AESD_LOG(LOG_ERR, "(%d) recv failed: %s", connection->id, strerror(-result));
+        }
+        uring_close(loop, connection);
+        return;
+    } else if (result == 0 || connection->closing) {
+        AESD_LOG(LOG_DEBUG, "(%d) end of receive data", connection->id);
+        if (flags & IORING_CQE_F_BUFFER) {
+            uring_recycle_buffer(loop, flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        uring_close(loop, connection);
+        return;
+    }
+
+    unsigned short buffer_id = flags >> IORING_CQE_BUFFER_SHIFT;
+    struct iovec received = {
+        .iov_base = loop->recv_buffers + buffer_id * loop->recv_buffer_size,
+        .iov_len = result
+    };
+    log_payload(connection->id, connection->fd, received.iov_base, result);
+    metrics_add(&metrics_thread()->bytes_received, result);
+
+    uint64_t seek_record;
+    uint64_t seek_offset;
+    if (connection->staging.length == 0 && parse_seek_command(&received, 1, result, &seek_record, &seek_offset)) {
+        uring_recycle_buffer(loop, buffer_id);
+        if (history_seek(&aesdsocket->history, seek_record, seek_offset, &connection->cursor) == FAILURE) {
+            AESD_LOG(LOG_WARNING, "(%d) invalid seek to record %ju offset %ju", connection->id,
+                (uintmax_t) seek_record, (uintmax_t) seek_offset);
+            uring_close(loop, connection);
+            return;
+        }
+        connection->state = CONNECTION_SENDING;
+        connection->send_end = __atomic_load_n(&aesdsocket->history.length, __ATOMIC_ACQUIRE);
+        connection->echo_start_ns = metrics_now_ns();
+        uring_send_next(aesdsocket, loop, connection);
+        return;
+    }
+
+    // Appends stay synchronous, history_appendv() orders them with everyone else's and
+    // indexes the records. The buffer can go back once the packets are framed and the rest
+    // is copied into staging.
+    size_t max_record = aesdsocket->config.max_record;
+    result_t received_result = receive_records(&aesdsocket->history, &connection->staging, &connection->pipeline,
+        max_record, &received, 1, result);
+    bool oversized = received_result == FAILURE && errno == EMSGSIZE;
+    uring_recycle_buffer(loop, buffer_id);
+    if (received_result == FAILURE) {
+        if (oversized) {
+            record_rejected(connection->id, max_record);
+        }
+        uring_close(loop, connection);
+        return;
+    }
+    uint64_t wait_ns = rate_limit_received(&aesdsocket->rate_limiter, connection->rate_bucket, &received, 1, result);
+    connection->throttle.tv_sec = wait_ns / 1000000000;
+    connection->throttle.tv_nsec = wait_ns % 1000000000;
+    if (!uring_next_packet(aesdsocket, loop, connection)) {
+        uring_receive(aesdsocket, loop, connection);
+    }
+}
+
+void uring_read(aesdsocket_t* aesdsocket, uring_connection_t* connection, int result) {
+    if (connection->read_file != NULL) {
+        history_file_release(&aesdsocket->history, connection->read_file);
+        connection->read_file = NULL;
+    }
+    if (result != (int) connection->read_length) {
+        AESD_LOG(LOG_ERR, "(%d) history read failed: %s", connection->id,
+            result < 0 ? strerror(-result) : "short read");
+        // The linked send comes back cancelled and closes the connection.
+        connection->closing = true;
+    }
+}
+
+void uring_sent(aesdsocket_t* aesdsocket, uring_loop_t* loop, uring_connection_t* connection, int result) {
+    if (connection->read_buffer != -1) {
+        loop->free_reads[loop->free_read_count++] = connection->read_buffer;
+        connection->read_buffer = -1;
+        if (!STAILQ_EMPTY(&loop->waiting)) {
+            uring_connection_t* waiting = STAILQ_FIRST(&loop->waiting);
+            STAILQ_REMOVE_HEAD(&loop->waiting, waiting_entries);
+            uring_send_next(aesdsocket, loop, waiting);
+        }
+    }
+    if (result < 0) {
+        if (result != -ECANCELED && !peer_gone(-result)) {
+            AESD_LOG(LOG_ERR, "(%d) send failed: %s", connection->id, strerror(-result));
+        }
+        uring_close(loop, connection);
+        return;
+    }
+    metrics_add(&metrics_thread()->bytes_sent, result);
+    connection->cursor.offset += result;
+    connection->cursor.segment_offset += result;
+    if (connection->closing) {
+        uring_close(loop, connection);
+    } else {
+        uring_send_next(aesdsocket, loop, connection);
+    }
+}
+
+void uring_closed(aesdsocket_t* aesdsocket, uring_loop_t* loop, uring_connection_t* connection) {
+    if (connection->fixed && !loop->direct_accept) {
+        loop->direct_accept = true;
+    }
+    loop->connections -= 1;
+    metrics_add(&metrics_thread()->connections_closed, 1);
+    int connections_count = __atomic_sub_fetch(&aesdsocket->connections_count, 1, __ATOMIC_RELAXED);
+    AESD_LOG(LOG_DEBUG, "removed connection %d. connections_count: %d", connection->id, connections_count);
+    staging_free(&connection->staging);
+    rate_limit_release(connection->rate_bucket);
+    object_pool_put(&loop->connection_pool, connection);
+    if (loop->accept_paused && !loop->draining) {
+        loop->accept_paused = false;
+        uring_accept(aesdsocket, loop);
+    }
+}
+
+// Stop taking new connections. The accept in flight comes back cancelled, or with a
+// connection if it won the race, and takes the rest of the backlog from there. Idle
+// keep-alive connections get their receive cancelled, which closes them.
+void uring_start_draining(aesdsocket_t* aesdsocket, uring_loop_t* loop) {
+    loop->draining = true;
+    uring_connection_t* connection = NULL;
+    LIST_FOREACH(connection, &loop->idle, idle_entries) {
+        if (connection->echoed) {
+            struct io_uring_sqe* sqe = uring_prep(loop, URING_OP_NONE, NULL, IORING_OP_ASYNC_CANCEL);
+            sqe->addr = (uint64_t) (uintptr_t) connection | URING_OP_RECV;
+        }
+    }
+    if (loop->accepting) {
+        struct io_uring_sqe* sqe = uring_prep(loop, URING_OP_NONE, NULL, IORING_OP_ASYNC_CANCEL);
+        sqe->addr = URING_OP_ACCEPT;
+    } else {
+        uring_accepted(aesdsocket, loop, -ECANCELED);
+    }
+}
+
+void uring_complete(aesdsocket_t* aesdsocket, uring_loop_t* loop, const struct io_uring_cqe* cqe) {
+    uring_op_t op = cqe->user_data & URING_OP_MASK;
+    uring_connection_t* connection = (uring_connection_t*) (uintptr_t) (cqe->user_data & ~(uint64_t) URING_OP_MASK);
+    if (connection != NULL) {
+        connection->inflight -= 1;
+    }
+    switch (op) {
+        case URING_OP_ACCEPT:
+            uring_accepted(aesdsocket, loop, cqe->res);
+            break;
+        case URING_OP_RECV:
+            uring_received(aesdsocket, loop, connection, cqe->res, cqe->flags);
+            break;
+        case URING_OP_READ:
+            uring_read(aesdsocket, connection, cqe->res);
+            break;
+        case URING_OP_SEND:
+            uring_sent(aesdsocket, loop, connection, cqe->res);
+            break;
+        case URING_OP_CLOSE:
+            // NULL for a slot that never got a connection.
+            if (connection != NULL) {
+                uring_closed(aesdsocket, loop, connection);
+            }
+            break;
+        case URING_OP_SHUTDOWN:
+            uring_start_draining(aesdsocket, loop);
+            break;
+        case URING_OP_NONE:
+            break;
+    }
+}
+
+void* manage_uring_thread(void* arg) {
+    uring_loop_t* loop = (uring_loop_t*) arg;
+    uring_t* ring = &loop->ring;
+    AESD_LOG(LOG_DEBUG, "manage_uring_thread() %d", loop->index);
+
+    struct io_uring_sqe* sqe = uring_prep(loop, URING_OP_SHUTDOWN, NULL, IORING_OP_POLL_ADD);
+    sqe->fd = g_aesdsocket.shutdown_fd;
+    sqe->poll32_events = POLLIN;
+    uring_accept(&g_aesdsocket, loop);
+
+    while (!loop->draining || loop->connections > 0 || loop->accepting) {
+        if (uring_submit(ring, 1) == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter");
+            return NULL;
+        }
+        unsigned head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+            head += 1;
+            // Release the entry first, handling it may queue enough to submit.
+            __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+            uring_complete(&g_aesdsocket, loop, &cqe);
+        }
+    }
+    AESD_LOG(LOG_DEBUG, "ring %d drained", loop->index);
+    return NULL;
+}
+
+// Everything a ring needs registered up front: sparse fixed file slots for accepted
+// sockets, the provided receive buffers and, for the file store, the read buffers.
+result_t uring_loop_init(aesdsocket_t* aesdsocket, uring_loop_t* loop) {
+    if (uring_init(&loop->ring, URING_ENTRIES) == FAILURE) {
+        return(FAILURE);
+    }
+    int ring_fd = loop->ring.ring_fd;
+
+    int* files = malloc(URING_FILES * sizeof(int));
+    if (files == NULL) {
+        return(FAILURE);
+    }
+    for (int i = 0; i < URING_FILES; i++) {
+        files[i] = -1;
+    }
+    int result = uring_register(ring_fd, IORING_REGISTER_FILES, files, URING_FILES);
+    free(files);
+    if (result == -1) {
         return(FAILURE);
     }
+    loop->direct_accept = true;
 
-    syslog(LOG_INFO, "Accepted connection from %s, id: %d, peer_fd: %d, thread_id: %ld",
-        client_ip, id, peer_fd, thread_id);
-    FILE* fp = fopen("/var/tmp/aesdsocketdata", "a+");
-    if (fp == NULL) {
-        perror("fopen failed");
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    loop->recv_buffer_size = aesdsocket->config.receive_buffer_size;
+    if (posix_memalign((void**) &loop->recv_ring, page_size, URING_RECV_BUFFERS * sizeof(struct io_uring_buf)) != 0) {
+        loop->recv_ring = NULL;
+        errno = ENOMEM;
+        return(FAILURE);
+    }
+    memset(loop->recv_ring, 0, URING_RECV_BUFFERS * sizeof(struct io_uring_buf));
+    loop->recv_buffers = malloc(URING_RECV_BUFFERS * loop->recv_buffer_size);
+    if (loop->recv_buffers == NULL) {
         return(FAILURE);
     }
+    struct io_uring_buf_reg buffer_reg = { 0 };
+    buffer_reg.ring_addr = (uint64_t) (uintptr_t) loop->recv_ring;
+    buffer_reg.ring_entries = URING_RECV_BUFFERS;
+    buffer_reg.bgid = URING_BUFFER_GROUP;
+    if (uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &buffer_reg, 1) == -1) {
+        return(FAILURE);
+    }
+    loop->recv_tail = 0;
+    for (int i = 0; i < URING_RECV_BUFFERS; i++) {
+        uring_recycle_buffer(loop, i);
+    }
 
-    // Receive data until we get a newline, writing data to file in chunks.
-    while (true) {
-        char receive_buffer[RECEIVE_BUFFER_SIZE];
-        // Leave room for a null byte so we can log/debug the results
-        int bytes_received = recv(peer_fd, receive_buffer, sizeof(receive_buffer) - 1, 0);
-        receive_buffer[bytes_received] = '\0';
-        if (bytes_received < 0) {
-            perror("recv failed");
+    STAILQ_INIT(&loop->waiting);
+    LIST_INIT(&loop->idle);
+    loop->idle_timeout = (struct __kernel_timespec) { .tv_sec = aesdsocket->config.idle_timeout };
+    object_pool_init(&loop->connection_pool, sizeof(uring_connection_t), false);
+    loop->free_read_count = 0;
+    if (aesdsocket->history.store == HISTORY_STORE_FILE) {
+        loop->read_buffers = malloc((size_t) URING_READ_BUFFERS * URING_READ_BUFFER_SIZE);
+        if (loop->read_buffers == NULL) {
             return(FAILURE);
-        } else if (bytes_received == 0) {
-            syslog(LOG_DEBUG, "end of receive data");
-            return(SUCCESS);
         }
-        syslog(LOG_INFO, "   (%d) (%d) (%ld): recv: (%d): '%s'",
-            id, peer_fd, thread_id, bytes_received, receive_buffer);
-
-        pthread_mutex_lock(&file_mutex);
-        int fputs_result = fputs(receive_buffer, fp);
-        fflush(fp);
-        pthread_mutex_unlock(&file_mutex);
-
-        if (fputs_result == EOF) {
-            perror("fputs failed");
+        struct iovec read_iov[URING_READ_BUFFERS];
+        for (int i = 0; i < URING_READ_BUFFERS; i++) {
+            read_iov[i].iov_base = loop->read_buffers + (size_t) i * URING_READ_BUFFER_SIZE;
+            read_iov[i].iov_len = URING_READ_BUFFER_SIZE;
+            loop->free_reads[loop->free_read_count++] = i;
+        }
+        if (uring_register(ring_fd, IORING_REGISTER_BUFFERS, read_iov, URING_READ_BUFFERS) == -1) {
             return(FAILURE);
         }
+    }
+    return SUCCESS;
+}
 
-        if (receive_buffer[bytes_received - 1] == '\n') {
-            syslog(LOG_DEBUG, "got newline");
-            break;
+// Kernels before 5.19 lack the buffer ring and direct accepts, older ones io_uring
+// altogether, and it may be disabled by sysctl or a seccomp filter.
+bool uring_supported(aesdsocket_t* aesdsocket, uring_loop_t* loop) {
+    if (uring_loop_init(aesdsocket, loop) == FAILURE) {
+        AESD_LOG(LOG_WARNING, "io_uring unavailable (%s), falling back to epoll", strerror(errno));
+        return false;
+    }
+    static const uint8_t opcodes[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_READ_FIXED,
+        IORING_OP_CLOSE, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL };
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, probe_size);
+    if (probe == NULL || uring_register(loop->ring.ring_fd, IORING_REGISTER_PROBE, probe, 256) == -1) {
+        AESD_LOG(LOG_WARNING, "io_uring probe failed (%s), falling back to epoll", strerror(errno));
+        free(probe);
+        return false;
+    }
+    for (size_t i = 0; i < sizeof(opcodes) / sizeof(opcodes[0]); i++) {
+        if (opcodes[i] > probe->last_op || !(probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED)) {
+            AESD_LOG(LOG_WARNING, "io_uring lacks opcode %d, falling back to epoll", opcodes[i]);
+            free(probe);
+            return false;
         }
     }
+    free(probe);
+    return true;
+}
 
-    if (fseek(fp, 0, SEEK_SET) != 0) {
-        perror("fseek failed");
+void uring_loop_free(uring_loop_t* loop) {
+    uring_free(&loop->ring);
+    free(loop->recv_ring);
+    free(loop->recv_buffers);
+    free(loop->read_buffers);
+}
+
+// Like the epoll mode, every ring accepts from the shared listener and owns its
+// connections for their lifetime. Each loop iteration is a single io_uring_enter() that
+// submits everything the last batch of completions queued and waits for the next.
+result_t run_uring_server(aesdsocket_t* aesdsocket) {
+    raise_open_file_limit();
+
+    int loop_count = aesdsocket->config.threads;
+    aesdsocket->uring_loops = calloc(loop_count, sizeof(uring_loop_t));
+    if (aesdsocket->uring_loops == NULL) {
+        perror("calloc uring_loops");
+        return(FAILURE);
+    }
+    for (int i = 0; i < loop_count; i++) {
+        aesdsocket->uring_loops[i].index = i;
+        aesdsocket->uring_loops[i].ring.ring_fd = -1;
+    }
+    if (!uring_supported(aesdsocket, &aesdsocket->uring_loops[0])) {
+        uring_loop_free(&aesdsocket->uring_loops[0]);
+        free(aesdsocket->uring_loops);
+        aesdsocket->uring_loops = NULL;
+        return run_event_loop_server(aesdsocket);
+    }
+    // Drain takes the backlog with plain non-blocking accepts.
+    if (set_non_blocking(aesdsocket->server_fd) == FAILURE) {
         return(FAILURE);
     }
 
-    // Read the file we stored received data in and send it back to the peer.
-    while (true) {
-        char read_buffer[SEND_BUFFER_SIZE];
-        int buffer_size = SEND_BUFFER_SIZE;
+    aesdsocket->acceptors = loop_count;
+    for (int i = 0; i < loop_count; i++) {
+        uring_loop_t* loop = &aesdsocket->uring_loops[i];
+        if (i > 0 && uring_loop_init(aesdsocket, loop) == FAILURE) {
+            perror("uring_loop_init");
+            return(FAILURE);
+        }
+        if (pthread_create(&loop->thread_id, NULL, manage_uring_thread, loop) != 0) {
+            perror("pthread_create");
+            return(FAILURE);
+        }
+    }
+    syslog(LOG_INFO, "started %d io_uring loops, listen backlog %d", loop_count, aesdsocket->config.listen_backlog);
+
+    for (int i = 0; i < loop_count; i++) {
+        pthread_join(aesdsocket->uring_loops[i].thread_id, NULL);
+    }
+    syslog(LOG_INFO, "all io_uring loops drained");
+    return SUCCESS;
+}
+
+// MARK: Thread per connection
+
+// Release the entry's thread and slot. The thread is done or about to be, joining it
+// takes no time.
+void reap_connection(aesdsocket_t* aesdsocket, connection_entry_t* entry) {
+    pthread_join(entry->thread_id, NULL);
+    if (registry_remove(&aesdsocket->registry, entry->handle) != entry) {
+        AESD_LOG(LOG_ERR, "connection %d has a stale handle", entry->id);
+    }
+    object_pool_put(&aesdsocket->entry_pool, entry);
+    int connections_count = __atomic_sub_fetch(&aesdsocket->connections_count, 1, __ATOMIC_RELAXED);
+    AESD_LOG(LOG_DEBUG, "removed connection. connections_count: %d", connections_count);
+}
+
+void join_completed_threads(aesdsocket_t* aesdsocket) {
+    connection_entry_t* entry = registry_take_completed(&aesdsocket->registry);
+    while (entry != NULL) {
+        connection_entry_t* next = entry->next_completed;
+        reap_connection(aesdsocket, entry);
+        entry = next;
+    }
+}
+
+result_t run_thread_server(aesdsocket_t* aesdsocket) {
+    if (set_non_blocking(aesdsocket->server_fd) == FAILURE) {
+        return(FAILURE);
+    }
+    aesdsocket->acceptors = 1;
+    while(true) {
+        int peer_fd = accept_until_shutdown(aesdsocket);
+        if (peer_fd == -1) {
+            if (errno == ECANCELED) {
+                stop_accepting(aesdsocket);
+                break;
+            }
+            metrics_add(&metrics_thread()->accept_errors, 1);
+            perror("accept failed");
+            AESD_LOG(LOG_ERR, "accept failed");
+            return(FAILURE);
+        }
+        metrics_add(&metrics_thread()->connections_opened, 1);
 
-        pthread_mutex_lock(&file_mutex);
-        int read_amount = fread(read_buffer, 1, buffer_size, fp);
-        if (read_amount == 0 && ferror(fp) != 0) {
-            perror("fread failed");
-            pthread_mutex_unlock(&file_mutex);
+        // Spawn a new thread to handle the accepted connection, its entry doubles as the
+        // thread's arguments.
+        connection_entry_t* new_connection = object_pool_get(&aesdsocket->entry_pool);
+        if (new_connection == NULL) {
+            close(peer_fd);
+            continue;
+        }
+        new_connection->id = aesdsocket->metrics.total_connections;
+        new_connection->peer_fd = peer_fd;
+        // The slot is taken before the thread exists, a thread that finishes right away
+        // already has a handle to be reaped by.
+        if (registry_add(&aesdsocket->registry, new_connection) == FAILURE) {
+            close(peer_fd);
+            object_pool_put(&aesdsocket->entry_pool, new_connection);
+            continue;
+        }
+        if (pthread_create(&new_connection->thread_id, NULL, manage_connection_thread, new_connection) != 0) {
+            perror("pthread_create");
             return(FAILURE);
         }
-        pthread_mutex_unlock(&file_mutex);
-        syslog(LOG_DEBUG, "fread: %d", read_amount);
+        aesdsocket->metrics.total_connections += 1;
+        int connections_count = __atomic_add_fetch(&aesdsocket->connections_count, 1, __ATOMIC_RELAXED);
 
-        int sent_amount = send(peer_fd, read_buffer, read_amount, 0);
-        syslog(LOG_DEBUG, "send: %d", sent_amount);
+        AESD_LOG(LOG_DEBUG, "new connection. connections_count: %d (all time: %d)",
+            connections_count, aesdsocket->metrics.total_connections);
 
-        if (sent_amount == -1) {
-            perror("send failed");
+        join_completed_threads(aesdsocket);
+    }
+
+    // Wait for every connection thread, the ones still running finish their echo first.
+    // Whatever is on the completed stack by then was reaped through its slot already.
+    for (uint32_t i = 0; i < aesdsocket->registry.capacity; i++) {
+        connection_entry_t* entry = aesdsocket->registry.slots[i].entry;
+        if (entry != NULL) {
+            reap_connection(aesdsocket, entry);
+        }
+    }
+    registry_take_completed(&aesdsocket->registry);
+    syslog(LOG_INFO, "all connection threads drained");
+    return SUCCESS;
+}
+
+// MARK: Worker pool
+
+result_t accept_queue_init(accept_queue_t* queue, size_t capacity) {
+    queue->entries = calloc(capacity, sizeof(connection_thread_args_t));
+    if (queue->entries == NULL) {
+        perror("calloc accept queue");
+        return(FAILURE);
+    }
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    return SUCCESS;
+}
+
+// Returns FAILURE without queueing when the queue is full and block is false.
+result_t accept_queue_push(accept_queue_t* queue, connection_thread_args_t entry, bool block) {
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == queue->capacity) {
+        if (!block) {
+            pthread_mutex_unlock(&queue->mutex);
             return(FAILURE);
         }
-        if (sent_amount != SEND_BUFFER_SIZE) {
+        pthread_cond_wait(&queue->not_full, &queue->mutex);
+    }
+    queue->entries[(queue->head + queue->count) % queue->capacity] = entry;
+    queue->count += 1;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->mutex);
+    return SUCCESS;
+}
+
+connection_thread_args_t accept_queue_pop(accept_queue_t* queue) {
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == 0) {
+        pthread_cond_wait(&queue->not_empty, &queue->mutex);
+    }
+    connection_thread_args_t entry = queue->entries[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count -= 1;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->mutex);
+    return entry;
+}
+
+void* manage_worker_thread(void* arg) {
+    accept_queue_t* queue = (accept_queue_t*) arg;
+    AESD_LOG(LOG_DEBUG, "manage_worker_thread()");
+
+    // Workers live for the whole run, their receive buffers are allocated once.
+    receive_chain_t receive_chain;
+    staging_t staging = { 0 };
+    if (receive_chain_init(&receive_chain, g_aesdsocket.config.receive_buffers,
+            g_aesdsocket.config.receive_buffer_size) == FAILURE) {
+        exit(-1);
+    }
+
+    while (true) {
+        connection_thread_args_t entry = accept_queue_pop(queue);
+        if (entry.peer_fd == -1) {
             break;
         }
+        // Unlike the thread per connection mode, a failed peer only costs its own socket.
+        // Staged leftovers belong to the last peer, the buffer itself is reused.
+        staging.length = 0;
+        if (handle_peer(&g_aesdsocket, &receive_chain, &staging, entry.id, entry.peer_fd) == FAILURE) {
+            AESD_LOG(LOG_ERR, "handle_peer failed for connection %d", entry.id);
+        }
+        close(entry.peer_fd);
+        metrics_add(&metrics_thread()->connections_closed, 1);
+        int connections_count = __atomic_sub_fetch(&g_aesdsocket.connections_count, 1, __ATOMIC_RELAXED);
+        AESD_LOG(LOG_DEBUG, "connection %d done. connections_count: %d", entry.id, connections_count);
     }
+    staging_free(&staging);
+    receive_chain_free(&receive_chain);
+    return NULL;
+}
 
-    if (fclose(fp) != 0) {
-        perror("fclose failed");
+// The acceptor hands sockets to a fixed set of pre-spawned workers, so the thread count
+// stays flat no matter how many clients connect. A full queue either stalls accept(),
+// leaving further clients in the kernel backlog, or closes the new connection right away.
+result_t run_pool_server(aesdsocket_t* aesdsocket) {
+    static accept_queue_t queue;
+    if (accept_queue_init(&queue, aesdsocket->config.accept_queue_depth) == FAILURE) {
         return(FAILURE);
     }
 
-    return(SUCCESS);
+    if (set_non_blocking(aesdsocket->server_fd) == FAILURE) {
+        return(FAILURE);
+    }
+    aesdsocket->acceptors = 1;
+
+    int worker_count = aesdsocket->config.threads;
+    pthread_t* workers = calloc(worker_count, sizeof(pthread_t));
+    if (workers == NULL) {
+        perror("calloc workers");
+        return(FAILURE);
+    }
+    for (int i = 0; i < worker_count; i++) {
+        if (pthread_create(&workers[i], NULL, manage_worker_thread, &queue) != 0) {
+            perror("pthread_create");
+            return(FAILURE);
+        }
+    }
+    syslog(LOG_INFO, "started %d pool workers, accept queue depth %d%s", worker_count,
+        aesdsocket->config.accept_queue_depth, aesdsocket->config.reject_when_full ? " (reject when full)" : "");
+
+    while (true) {
+        int peer_fd = accept_until_shutdown(aesdsocket);
+        if (peer_fd == -1) {
+            if (errno == ECANCELED) {
+                stop_accepting(aesdsocket);
+                break;
+            }
+            metrics_add(&metrics_thread()->accept_errors, 1);
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("accept failed");
+            AESD_LOG(LOG_ERR, "accept failed");
+            return(FAILURE);
+        }
+
+        connection_thread_args_t entry;
+        entry.id = aesdsocket->metrics.total_connections;
+        entry.peer_fd = peer_fd;
+        aesdsocket->metrics.total_connections += 1;
+        metrics_add(&metrics_thread()->connections_opened, 1);
+
+        __atomic_add_fetch(&aesdsocket->connections_count, 1, __ATOMIC_RELAXED);
+        if (accept_queue_push(&queue, entry, !aesdsocket->config.reject_when_full) == FAILURE) {
+            __atomic_sub_fetch(&aesdsocket->connections_count, 1, __ATOMIC_RELAXED);
+            metrics_add(&metrics_thread()->connections_rejected, 1);
+            metrics_add(&metrics_thread()->connections_closed, 1);
+            AESD_LOG(LOG_WARNING, "accept queue full, rejecting connection %d", entry.id);
+            close(peer_fd);
+        }
+    }
+
+    // One stop entry per worker, queued behind the connections still waiting so those
+    // are served first.
+    connection_thread_args_t stop = { .id = 0, .peer_fd = -1 };
+    for (int i = 0; i < worker_count; i++) {
+        accept_queue_push(&queue, stop, true);
+    }
+    for (int i = 0; i < worker_count; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    syslog(LOG_INFO, "all pool workers drained");
+    return SUCCESS;
 }
 
-void* manage_connection_thread(void* arg) {
-    syslog(LOG_DEBUG, "manage_connection_thread()");
-    pthread_t thread_id = pthread_self();
-    connection_thread_args_t* thread_args = (connection_thread_args_t*) arg;
-    uint32_t id = thread_args->id;
-    int peer_fd = thread_args->peer_fd;
+// MARK: Metrics endpoint
+
+void metrics_sum_histogram(metrics_histogram_t* total, const metrics_histogram_t* histogram) {
+    for (int i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+        total->buckets[i] += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+    }
+    total->sum_ns += __atomic_load_n(&histogram->sum_ns, __ATOMIC_RELAXED);
+    total->count += __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+}
+
+void metrics_write_histogram(FILE* out, const char* name, const char* help, const metrics_histogram_t* histogram) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    uint64_t cumulative = 0;
+    for (int i = 0; i < METRICS_HISTOGRAM_BUCKETS - 1; i++) {
+        cumulative += histogram->buckets[i];
+        fprintf(out, "%s_bucket{le=\"%g\"} %ju\n", name, (double) (1ull << i) / 1e6, (uintmax_t) cumulative);
+    }
+    cumulative += histogram->buckets[METRICS_HISTOGRAM_BUCKETS - 1];
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %ju\n", name, (uintmax_t) cumulative);
+    fprintf(out, "%s_sum %.9f\n%s_count %ju\n", name, histogram->sum_ns / 1e9, name, (uintmax_t) histogram->count);
+}
+
+void metrics_write_counter(FILE* out, const char* name, const char* type, const char* help, uint64_t value) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %ju\n", name, help, name, type, name, (uintmax_t) value);
+}
+
+// Aggregate every thread's counters and write them in the Prometheus text format.
+void metrics_write(FILE* out, aesdsocket_t* aesdsocket) {
+    thread_metrics_t total = { 0 };
+    pthread_mutex_lock(&aesdsocket->metrics.registry_mutex);
+    for (thread_metrics_t* thread_metrics = aesdsocket->metrics.threads; thread_metrics != NULL;
+            thread_metrics = thread_metrics->next) {
+        total.connections_opened += __atomic_load_n(&thread_metrics->connections_opened, __ATOMIC_RELAXED);
+        total.connections_closed += __atomic_load_n(&thread_metrics->connections_closed, __ATOMIC_RELAXED);
+        total.connections_rejected += __atomic_load_n(&thread_metrics->connections_rejected, __ATOMIC_RELAXED);
+        total.accept_errors += __atomic_load_n(&thread_metrics->accept_errors, __ATOMIC_RELAXED);
+        total.records_rejected += __atomic_load_n(&thread_metrics->records_rejected, __ATOMIC_RELAXED);
+        total.reads_throttled += __atomic_load_n(&thread_metrics->reads_throttled, __ATOMIC_RELAXED);
+        total.bytes_received += __atomic_load_n(&thread_metrics->bytes_received, __ATOMIC_RELAXED);
+        total.bytes_sent += __atomic_load_n(&thread_metrics->bytes_sent, __ATOMIC_RELAXED);
+        total.history_writes += __atomic_load_n(&thread_metrics->history_writes, __ATOMIC_RELAXED);
+        total.history_syncs += __atomic_load_n(&thread_metrics->history_syncs, __ATOMIC_RELAXED);
+        metrics_sum_histogram(&total.append_latency, &thread_metrics->append_latency);
+        metrics_sum_histogram(&total.echo_latency, &thread_metrics->echo_latency);
+    }
+    pthread_mutex_unlock(&aesdsocket->metrics.registry_mutex);
+
+    // Opened and closed are read from different threads at slightly different times.
+    uint64_t active = total.connections_opened > total.connections_closed
+        ? total.connections_opened - total.connections_closed : 0;
+
+    metrics_write_counter(out, "aesdsocket_connections_total", "counter", "Accepted connections.", total.connections_opened);
+    metrics_write_counter(out, "aesdsocket_connections_active", "gauge", "Connections currently open.", active);
+    metrics_write_counter(out, "aesdsocket_connections_rejected_total", "counter",
+        "Connections closed because the accept queue was full.", total.connections_rejected);
+    metrics_write_counter(out, "aesdsocket_accept_errors_total", "counter", "Failed accept() calls.", total.accept_errors);
+    metrics_write_counter(out, "aesdsocket_records_rejected_total", "counter",
+        "Connections closed for a record longer than --max-record.", total.records_rejected);
+    metrics_write_counter(out, "aesdsocket_reads_throttled_total", "counter",
+        "Reads that put a client over its rate limit.", total.reads_throttled);
+    metrics_write_counter(out, "aesdsocket_received_bytes_total", "counter", "Bytes received from peers.", total.bytes_received);
+    metrics_write_counter(out, "aesdsocket_sent_bytes_total", "counter", "Bytes echoed to peers.", total.bytes_sent);
+    metrics_write_counter(out, "aesdsocket_history_bytes", "gauge", "Length of the packet history.",
+        __atomic_load_n(&aesdsocket->history.length, __ATOMIC_RELAXED));
+    metrics_write_counter(out, "aesdsocket_history_retained_bytes", "gauge", "Bytes of the history still retained.",
+        __atomic_load_n(&aesdsocket->history.length, __ATOMIC_RELAXED)
+            - __atomic_load_n(&aesdsocket->history.start, __ATOMIC_RELAXED));
+    metrics_write_counter(out, "aesdsocket_history_writes_total", "counter",
+        "pwritev() calls writing the memory store behind.", total.history_writes);
+    metrics_write_counter(out, "aesdsocket_history_syncs_total", "counter",
+        "fdatasync() batches under the sync policy.", total.history_syncs);
+    metrics_write_histogram(out, "aesdsocket_append_duration_seconds", "Time to append received data to the history.",
+        &total.append_latency);
+    metrics_write_histogram(out, "aesdsocket_echo_duration_seconds", "Time to echo the history back after a packet completed.",
+        &total.echo_latency);
+}
 
-    free(thread_args);
+// Any connection to the endpoint gets the current metrics. A request, if the client
+// sends one (Prometheus sends an HTTP GET), is read and ignored, and the response is
+// plain HTTP/1.0 so both scrapers and 'nc' work.
+void* manage_metrics_thread(void* arg) {
+    aesdsocket_t* aesdsocket = (aesdsocket_t*) arg;
+    while (true) {
+        int peer_fd = accept(aesdsocket->metrics.server_fd, NULL, NULL);
+        if (peer_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("metrics accept failed");
+            return NULL;
+        }
 
-    if (handle_peer(id, peer_fd, g_aesdsocket.file_mutex) == FAILURE) {
-        perror("handle_peer failed");
+        struct pollfd request_poll = { .fd = peer_fd, .events = POLLIN };
+        if (poll(&request_poll, 1, 100) > 0) {
+            char request[1024];
+            recv(peer_fd, request, sizeof(request), MSG_DONTWAIT);
+        }
+
+        char* body = NULL;
+        size_t body_length = 0;
+        FILE* out = open_memstream(&body, &body_length);
+        if (out != NULL) {
+            metrics_write(out, aesdsocket);
+            fclose(out);
+            char header[128];
+            int header_length = snprintf(header, sizeof(header),
+                "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", body_length);
+            send(peer_fd, header, header_length, MSG_NOSIGNAL);
+            send(peer_fd, body, body_length, MSG_NOSIGNAL);
+            free(body);
+        }
         close(peer_fd);
-        exit(-1);
     }
-    close(peer_fd);
+}
 
-    struct connection_entry_s *entry = NULL;
-    pthread_mutex_lock(&g_aesdsocket.connections_mutex);
-    SLIST_FOREACH(entry, &g_aesdsocket.connections, entries) {
-        if (entry->id == id) {
-            syslog(LOG_DEBUG, "thread %d - %ld done", id, thread_id);
-            entry->done = true;
+// Listen on 127.0.0.1:port or on a unix socket path, whichever is configured.
+result_t start_metrics_server(aesdsocket_t* aesdsocket) {
+    const aesdsocket_config_t* config = &aesdsocket->config;
+    int server_fd;
+    if (config->metrics_socket != NULL) {
+        struct sockaddr_un address = { .sun_family = AF_UNIX };
+        if (strlen(config->metrics_socket) >= sizeof(address.sun_path)) {
+            fprintf(stderr, "metrics socket path too long\n");
+            return(FAILURE);
+        }
+        strcpy(address.sun_path, config->metrics_socket);
+        unlink(config->metrics_socket);
+        server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (server_fd == -1 || bind(server_fd, (struct sockaddr*) &address, sizeof(address)) != 0) {
+            perror("metrics bind failed");
+            return(FAILURE);
+        }
+    } else {
+        addrinfo_t address_hints = { 0 };
+        addrinfo_t* address = NULL;
+        address_hints.ai_family = AF_INET;
+        address_hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo("127.0.0.1", config->metrics_port, &address_hints, &address) != 0) {
+            perror("metrics getaddrinfo");
+            return(FAILURE);
         }
+        server_fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+        int enabled = 1;
+        if (server_fd == -1
+                || setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled)) != 0
+                || bind(server_fd, address->ai_addr, address->ai_addrlen) != 0) {
+            perror("metrics bind failed");
+            freeaddrinfo(address);
+            return(FAILURE);
+        }
+        freeaddrinfo(address);
     }
-    pthread_mutex_unlock(&g_aesdsocket.connections_mutex);
-    return NULL;
+
+    if (listen(server_fd, 8) != 0) {
+        perror("metrics listen failed");
+        return(FAILURE);
+    }
+    aesdsocket->metrics.server_fd = server_fd;
+    return SUCCESS;
+}
+
+// MARK: Options
+
+static const struct option long_options[] = {
+    {"daemon", no_argument, NULL, 'd'},
+    {"mode", required_argument, NULL, 'm'},
+    {"threads", required_argument, NULL, 'n'},
+    {"queue-depth", required_argument, NULL, 'q'},
+    {"reject", no_argument, NULL, 'r'},
+    {"recv-buffer", required_argument, NULL, 'b'},
+    {"recv-buffers", required_argument, NULL, 'B'},
+    {"drain-timeout", required_argument, NULL, 'T'},
+    {"backlog", required_argument, NULL, 'k'},
+    {"reuseport", no_argument, NULL, 'R'},
+    {"defer-accept", required_argument, NULL, 'D'},
+    {"sndbuf", required_argument, NULL, 'o'},
+    {"rcvbuf", required_argument, NULL, 'j'},
+    {"nodelay", required_argument, NULL, 'Y'},
+    {"tail", no_argument, NULL, 't'},
+    {"keep-alive", no_argument, NULL, 'A'},
+    {"idle-timeout", required_argument, NULL, 'i'},
+    {"max-record", required_argument, NULL, 'x'},
+    {"rate-bytes", required_argument, NULL, 'e'},
+    {"rate-records", required_argument, NULL, 'E'},
+    {"persist-index", no_argument, NULL, 'I'},
+    {"segment-size", required_argument, NULL, 'G'},
+    {"retain-bytes", required_argument, NULL, 'K'},
+    {"retain-records", required_argument, NULL, 'N'},
+    {"sync", required_argument, NULL, 'y'},
+    {"sync-interval", required_argument, NULL, 'w'},
+    {"store", required_argument, NULL, 's'},
+    {"no-persist", no_argument, NULL, 'P'},
+    {"no-zero-copy", no_argument, NULL, 'Z'},
+    {"file-read", required_argument, NULL, 'F'},
+    {"log-level", required_argument, NULL, 'l'},
+    {"log-payload", required_argument, NULL, 'L'},
+    {"log-sample", required_argument, NULL, 'S'},
+    {"metrics-port", required_argument, NULL, 'M'},
+    {"metrics-socket", required_argument, NULL, 'U'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0},
+};
+
+void print_usage(const char* program) {
+    fprintf(stderr,
+        "usage: %s [-d] [-m epoll|thread|pool|uring] [-n threads] [-q depth] [-r] [-b bytes] [-B count] [-T seconds]\n"
+        "       [-k backlog] [--reuseport] [--defer-accept seconds] [--sndbuf bytes] [--rcvbuf bytes]\n"
+        "       [--nodelay on|off] [--tail | --keep-alive [-i seconds]]\n"
+        "       [--max-record bytes] [--rate-bytes bytes] [--rate-records count]\n"
+        "       [-s memory|file] [--no-persist] [-F sendfile|pread|mmap] [--persist-index]\n"
+        "       [--segment-size bytes] [--retain-bytes bytes] [--retain-records count]\n"
+        "       [--sync none|batch|interval] [--sync-interval ms]\n"
+        "       [-l level] [--log-payload bytes] [--log-sample n] [--metrics-port port | --metrics-socket path]\n"
+        "  -d, --daemon          fork into the background after binding\n"
+        "  -m, --mode MODE       epoll (default): event loops on non-blocking sockets\n"
+        "                        thread: one thread per connection\n"
+        "                        pool: fixed worker threads fed by a bounded accept queue\n"
+        "                        uring: event loops on io_uring with fixed files and registered\n"
+        "                        buffers, falls back to epoll if the kernel lacks support\n"
+        "  -n, --threads COUNT   event loops or rings (default %d) or pool workers (default %d)\n"
+        "  -q, --queue-depth N   pool mode accept queue depth (default %d)\n"
+        "  -r, --reject          pool mode: close new connections while the queue is full\n"
+        "                        instead of pausing accept()\n"
+        "  -b, --recv-buffer N   size of each receive buffer (default %d)\n"
+        "  -B, --recv-buffers N  receive buffers filled per readv() (default %d, max %d)\n"
+        "  -T, --drain-timeout S on SIGINT/SIGTERM, give open connections S seconds to finish\n"
+        "                        before exiting (default %d), a second signal exits right away\n"
+        "  -k, --backlog N       listen() backlog (default %d, capped by net.core.somaxconn)\n"
+        "  -R, --reuseport       epoll mode: give every loop its own SO_REUSEPORT listener and\n"
+        "                        pin the loops to CPUs\n"
+        "      --defer-accept S  only accept once a client sent data, waiting up to S seconds\n"
+        "      --sndbuf N        SO_SNDBUF of accepted sockets (default: the kernel's autotuning)\n"
+        "      --rcvbuf N        SO_RCVBUF of accepted sockets (default: the kernel's autotuning)\n"
+        "      --nodelay on|off  TCP_NODELAY on accepted sockets (default: on with --keep-alive)\n"
+        "  -t, --tail            keep connections open after their echo and stream everything\n"
+        "                        appended from then on until the client closes. In the pool\n"
+        "                        mode every such connection holds a worker\n"
+        "  -A, --keep-alive      keep connections open for any number of packets, a client may\n"
+        "                        send several back to back and gets their echoes in order. In\n"
+        "                        the pool mode every such connection holds a worker\n"
+        "  -i, --idle-timeout S  keep-alive: close connections quiet for S seconds between\n"
+        "                        packets (default %d, 0 for never)\n"
+        "      --max-record N    longest record a client may send, newline included, a longer\n"
+        "                        one closes the connection unappended (default %d)\n"
+        "      --rate-bytes N    limit every client address to N received bytes per second\n"
+        "      --rate-records N  limit every client address to N received records per second\n"
+        "                        a client over its limit isn't read until it's back within it,\n"
+        "                        bursts of up to a second's worth go through right away\n"
+        "  -s, --store STORE     memory (default): echo from an in-memory log written behind\n"
+        "                        to " DATA_FILE_PATH "\n"
+        "                        file: append to and echo from " DATA_FILE_PATH "\n"
+        "      --no-persist      memory store: don't write the data file at all\n"
+        "  -F, --file-read HOW   file store: echo with sendfile() (default), pread()/send() or\n"
+        "                        send() out of the data file mapped with mmap()\n"
+        "      --no-zero-copy    same as --file-read pread\n"
+        "      --persist-index   file store: keep the record index in " INDEX_FILE_PATH "\n"
+        "                        so a restart doesn't rescan the whole data file\n"
+        "      --segment-size N  file store: split the log into files of N bytes named\n"
+        "                        " DATA_FILE_PATH ".NNNNNNNN (default %d with a cap)\n"
+        "      --retain-bytes N  file store: only keep the newest records within N bytes,\n"
+        "                        older segment files are deleted\n"
+        "      --retain-records N\n"
+        "                        file store: only keep the newest N records\n"
+        "      --sync POLICY     none (default): leave writing back to the kernel\n"
+        "                        batch: fdatasync() every batch of appends\n"
+        "                        interval: fdatasync() at most once per sync interval\n"
+        "                        with batch or interval, echoes wait until their packet is synced\n"
+        "      --sync-interval MS\n"
+        "                        interval policy sync period (default %d)\n"
+        "  -l, --log-level LEVEL error, warning, info (default) or debug\n"
+        "      --log-payload N   log at most N bytes of each received payload (default %d, 0 for none)\n"
+        "      --log-sample N    log only one in every N received payloads (default 1)\n"
+        "  -M, --metrics-port P  serve Prometheus text metrics on 127.0.0.1:P\n"
+        "  -U, --metrics-socket PATH\n"
+        "                        serve the metrics on a unix socket instead\n",
+        program, DEFAULT_EVENT_LOOP_THREADS, DEFAULT_POOL_WORKERS, DEFAULT_ACCEPT_QUEUE_DEPTH,
+        RECEIVE_BUFFER_SIZE, RECEIVE_BUFFERS, RECEIVE_CHAIN_MAX, DEFAULT_DRAIN_TIMEOUT, DEFAULT_LISTEN_BACKLOG,
+        DEFAULT_IDLE_TIMEOUT, DEFAULT_MAX_RECORD, DEFAULT_SEGMENT_SIZE, DEFAULT_SYNC_INTERVAL_MS, DEFAULT_LOG_PAYLOAD_MAX);
+}
+
+result_t parse_options(aesdsocket_config_t* config, int argc, char* argv[]) {
+    config->daemon_mode = false;
+    config->mode = SERVER_MODE_EPOLL;
+    config->threads = 0;
+    config->accept_queue_depth = DEFAULT_ACCEPT_QUEUE_DEPTH;
+    config->reject_when_full = false;
+    config->receive_buffer_size = RECEIVE_BUFFER_SIZE;
+    config->receive_buffers = RECEIVE_BUFFERS;
+    config->drain_timeout = DEFAULT_DRAIN_TIMEOUT;
+    config->listen_backlog = DEFAULT_LISTEN_BACKLOG;
+    config->reuseport = false;
+    config->defer_accept = 0;
+    config->socket_send_buffer = 0;
+    config->socket_receive_buffer = 0;
+    config->nodelay = -1;
+    config->tail = false;
+    config->keep_alive = false;
+    config->idle_timeout = DEFAULT_IDLE_TIMEOUT;
+    config->max_record = DEFAULT_MAX_RECORD;
+    config->rate_bytes = 0;
+    config->rate_records = 0;
+    config->persist_index = false;
+    config->segment_size = 0;
+    config->retain_bytes = 0;
+    config->retain_records = 0;
+    config->sync = HISTORY_SYNC_NONE;
+    config->sync_interval_ms = DEFAULT_SYNC_INTERVAL_MS;
+    config->store = HISTORY_STORE_MEMORY;
+    config->persist = true;
+    config->read_path = HISTORY_READ_SENDFILE;
+    config->log_level = LOG_INFO;
+    config->log_payload_max = DEFAULT_LOG_PAYLOAD_MAX;
+    config->log_sample = 1;
+    config->metrics_port = NULL;
+    config->metrics_socket = NULL;
+
+    int option;
+    while ((option = getopt_long(argc, argv, "dm:n:q:rb:B:T:k:RD:o:j:Y:tAi:x:e:E:s:PZF:IG:K:N:y:w:l:L:S:M:U:h", long_options, NULL)) != -1) {
+        switch (option) {
+            case 'd':
+                config->daemon_mode = true;
+                break;
+            case 'm':
+                if (strcmp(optarg, "epoll") == 0) {
+                    config->mode = SERVER_MODE_EPOLL;
+                } else if (strcmp(optarg, "thread") == 0) {
+                    config->mode = SERVER_MODE_THREAD;
+                } else if (strcmp(optarg, "pool") == 0) {
+                    config->mode = SERVER_MODE_POOL;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    config->mode = SERVER_MODE_URING;
+                } else {
+                    fprintf(stderr, "unknown mode: %s\n", optarg);
+                    return(FAILURE);
+                }
+                break;
+            case 'n':
+                config->threads = atoi(optarg);
+                if (config->threads <= 0) {
+                    fprintf(stderr, "invalid thread count: %s\n", optarg);
+                    return(FAILURE);
+                }
+                break;
+            case 'q':
+                config->accept_queue_depth = atoi(optarg);
+                if (config->accept_queue_depth <= 0) {
+                    fprintf(stderr, "invalid queue depth: %s\n", optarg);
+                    return(FAILURE);
+                }
+                break;
+            case 'r':
+                config->reject_when_full = true;
+                break;
+            case 'b':
+                config->receive_buffer_size = strtoul(optarg, NULL, 10);
+                if (config->receive_buffer_size == 0) {
+                    fprintf(stderr, "invalid receive buffer size: %s\n", optarg);
+                    return(FAILURE);
+                }
+                break;
+            case 'B':
+                config->receive_buffers = atoi(optarg);
+                if (config->receive_buffers <= 0 || config->receive_buffers > RECEIVE_CHAIN_MAX) {
+                    fprintf(stderr, "invalid receive buffer count: %s\n", optarg);
+                    return(FAILURE);
+                }
+                break;
+            case 'T':
+                config->drain_timeout = atoi(optarg);
+                if (config->drain_timeout < 0) {
+                    fprintf(stderr, "invalid drain timeout: %s\n", optarg);
+                    return(FAILURE);
+                }
+                break;
+            case 'k':
+                config->listen_backlog = atoi(optarg);
+                if (config->listen_backlog <= 0) {
+                    fprintf(stderr, "invalid backlog: %s\n", optarg);
+                    return(FAILURE);
+                }
+                break;
+            case 'R':
+                config->reuseport = true;
+                break;
+            case 't':
+                config->tail = true;
+                break;
+            case 'A':
+                config->keep_alive = true;
+                break;
+            case 'i':
+                config->idle_timeout = atoi(optarg);
+                if (config->idle_timeout < 0) {
+                    fprintf(stderr, "invalid idle timeout: %s\n", optarg);
+                    return(FAILURE);
+                }
+                break;
+            case 'x':
+                config->max_record = strtoull(optarg, NULL, 10);
+                if (config->max_record == 0) {
+                    fprintf(stderr, "invalid max record size: %s\n", optarg);
+                    return(FAILURE);
+                }
+                break;
+            case 'e':
+                config->rate_bytes = strtoull(optarg, NULL, 10);
+                if (config->rate_bytes == 0) {
+                    fprintf(stderr, "invalid byte rate: %s\n", optarg);
+                    return(FAILURE);
+                }
+                break;
+            case 'E':
+                config->rate_records = strtoull(optarg, NULL, 10);
+                if (config->rate_records == 0) {
+                    fprintf(stderr, "invalid record rate: %s\n", optarg);
+                    return(FAILURE);
+                }
+                break;
+            case 'o':
+                config->socket_send_buffer = atoi(optarg);
+                if (config->socket_send_buffer <= 0) {
+                    fprintf(stderr, "invalid socket send buffer: %s\n", optarg);
+                    return(FAILURE);
+                }
+                break;
+            case 'j':
+                config->socket_receive_buffer = atoi(optarg);
+                if (config->socket_receive_buffer <= 0) {
+                    fprintf(stderr, "invalid socket receive buffer: %s\n", optarg);
+                    return(FAILURE);
+                }
+                break;
+            case 'Y':
+                if (strcmp(optarg, "on") == 0) {
+                    config->nodelay = 1;
+                } else if (strcmp(optarg, "off") == 0) {
+                    config->nodelay = 0;
+                } else {
+                    fprintf(stderr, "--nodelay takes on or off: %s\n", optarg);
+                    return(FAILURE);
+                }
+                break;
+            case 'D':
+                config->defer_accept = atoi(optarg);
+                if (config->defer_accept < 0) {
+                    fprintf(stderr, "invalid defer accept timeout: %s\n", optarg);
+                    return(FAILURE);
+                }
+                break;
+            case 's':
+                if (strcmp(optarg, "memory") == 0) {
+                    config->store = HISTORY_STORE_MEMORY;
+                } else if (strcmp(optarg, "file") == 0) {
+                    config->store = HISTORY_STORE_FILE;
+                } else {
+                    fprintf(stderr, "unknown store: %s\n", optarg);
+                    return(FAILURE);
+                }
+                break;
+            case 'P':
+                config->persist = false;
+                break;
+            case 'Z':
+                config->read_path = HISTORY_READ_PREAD;
+                break;
+            case 'F':
+                if (strcmp(optarg, "sendfile") == 0) {
+                    config->read_path = HISTORY_READ_SENDFILE;
+                } else if (strcmp(optarg, "pread") == 0) {
+                    config->read_path = HISTORY_READ_PREAD;
+                } else if (strcmp(optarg, "mmap") == 0) {
+                    config->read_path = HISTORY_READ_MMAP;
+                } else {
+                    fprintf(stderr, "unknown file read path: %s\n", optarg);
+                    return(FAILURE);
+                }
+                break;
+            case 'I':
+                config->persist_index = true;
+                break;
+            case 'G':
+                config->segment_size = strtoull(optarg, NULL, 10);
+                if (config->segment_size < MIN_SEGMENT_SIZE) {
+                    fprintf(stderr, "segment size must be at least %d: %s\n", MIN_SEGMENT_SIZE, optarg);
+                    return(FAILURE);
+                }
+                break;
+            case 'K':
+                config->retain_bytes = strtoull(optarg, NULL, 10);
+                if (config->retain_bytes == 0) {
+                    fprintf(stderr, "invalid retained bytes: %s\n", optarg);
+                    return(FAILURE);
+                }
+                break;
+            case 'N':
+                config->retain_records = strtoull(optarg, NULL, 10);
+                if (config->retain_records == 0) {
+                    fprintf(stderr, "invalid retained records: %s\n", optarg);
+                    return(FAILURE);
+                }
+                break;
+            case 'y':
+                if (strcmp(optarg, "none") == 0) {
+                    config->sync = HISTORY_SYNC_NONE;
+                } else if (strcmp(optarg, "batch") == 0) {
+                    config->sync = HISTORY_SYNC_BATCH;
+                } else if (strcmp(optarg, "interval") == 0) {
+                    config->sync = HISTORY_SYNC_INTERVAL;
+                } else {
+                    fprintf(stderr, "unknown sync policy: %s\n", optarg);
+                    return(FAILURE);
+                }
+                break;
+            case 'w':
+                config->sync_interval_ms = atoi(optarg);
+                if (config->sync_interval_ms <= 0) {
+                    fprintf(stderr, "invalid sync interval: %s\n", optarg);
+                    return(FAILURE);
+                }
+                break;
+            case 'l':
+                if (strcmp(optarg, "error") == 0) {
+                    config->log_level = LOG_ERR;
+                } else if (strcmp(optarg, "warning") == 0) {
+                    config->log_level = LOG_WARNING;
+                } else if (strcmp(optarg, "info") == 0) {
+                    config->log_level = LOG_INFO;
+                } else if (strcmp(optarg, "debug") == 0) {
+                    config->log_level = LOG_DEBUG;
+                } else {
+                    fprintf(stderr, "unknown log level: %s\n", optarg);
+                    return(FAILURE);
+                }
+                break;
+            case 'L':
+                config->log_payload_max = strtoul(optarg, NULL, 10);
+                break;
+            case 'S':
+                config->log_sample = atoi(optarg);
+                if (config->log_sample <= 0) {
+                    fprintf(stderr, "invalid log sample: %s\n", optarg);
+                    return(FAILURE);
+                }
+                break;
+            case 'M':
+                config->metrics_port = optarg;
+                break;
+            case 'U':
+                config->metrics_socket = optarg;
+                break;
+            default:
+                return(FAILURE);
+        }
+    }
+
+    if (config->retain_bytes != 0 || config->retain_records != 0) {
+        if (config->segment_size == 0) {
+            config->segment_size = DEFAULT_SEGMENT_SIZE;
+        }
+    }
+    if (config->segment_size != 0 && config->store != HISTORY_STORE_FILE) {
+        // Lock free readers hold on to memory segments, nothing could ever free one.
+        fprintf(stderr, "--segment-size and --retain-* need the file store\n");
+        return(FAILURE);
+    }
+    if (config->sync != HISTORY_SYNC_NONE && config->store == HISTORY_STORE_MEMORY && !config->persist) {
+        fprintf(stderr, "--sync needs the data file, it can't be used with --no-persist\n");
+        return(FAILURE);
+    }
+    if (config->segment_size != 0 && config->persist_index) {
+        fprintf(stderr, "--persist-index only works with a single data file\n");
+        return(FAILURE);
+    }
+    if (config->persist_index && config->store != HISTORY_STORE_FILE) {
+        fprintf(stderr, "--persist-index needs the file store\n");
+        return(FAILURE);
+    }
+    if (config->tail && config->keep_alive) {
+        fprintf(stderr, "--tail and --keep-alive can't be combined\n");
+        return(FAILURE);
+    }
+    if (config->reuseport && config->mode != SERVER_MODE_EPOLL) {
+        fprintf(stderr, "--reuseport needs the epoll mode\n");
+        return(FAILURE);
+    }
+    if (config->mode == SERVER_MODE_URING && (config->tail || config->sync != HISTORY_SYNC_NONE)) {
+        fprintf(stderr, "--tail and --sync aren't supported in the uring mode\n");
+        return(FAILURE);
+    }
+    if (config->threads == 0) {
+        config->threads = config->mode == SERVER_MODE_POOL ? DEFAULT_POOL_WORKERS : DEFAULT_EVENT_LOOP_THREADS;
+    }
+    return SUCCESS;
 }
 
 // MARK: main
 
 int main(int argc, char* argv[]) {
     openlog("aesdsocket", LOG_PID, LOG_USER);
+    newline_scan_init();
     register_signal_handlers();
+    sigset_t shutdown_signals;
+    if (block_shutdown_signals(&shutdown_signals) == FAILURE) {
+        exit(-1);
+    }
     init_aesdsocket(&g_aesdsocket);
 
-    bool daemon_mode = false;
-    if (argc >= 2) {
-        if (strncmp(argv[1], "-d", sizeof("-d")) == 0) {
-            daemon_mode = true;
-        }
+    if (parse_options(&g_aesdsocket.config, argc, argv) == FAILURE) {
+        print_usage(argv[0]);
+        exit(-1);
     }
 
+    g_log_level = g_aesdsocket.config.log_level;
+    setlogmask(LOG_UPTO(g_log_level));
+    g_aesdsocket.log.payload_max = g_aesdsocket.config.log_payload_max;
+    g_aesdsocket.log.sample = g_aesdsocket.config.log_sample;
+    rate_limiter_init(&g_aesdsocket.rate_limiter, g_aesdsocket.config.rate_bytes, g_aesdsocket.config.rate_records);
+
     syslog(LOG_INFO, " "); // some empty space to make the syslog easier to scan
     syslog(LOG_INFO, " ");
     syslog(LOG_INFO, "Starting aesdsocket");
-    socklen_t address_length = 0;
-    if (start_listen_server(&g_aesdsocket.server_fd, &g_aesdsocket.address, &address_length) == FAILURE) {
+    if (start_listen_server(&g_aesdsocket.server_fd, &g_aesdsocket.address, &g_aesdsocket.config) == FAILURE) {
         perror("start_listen_server failed");
         exit(-1);
     }
+    if ((g_aesdsocket.config.metrics_port != NULL || g_aesdsocket.config.metrics_socket != NULL)
+            && start_metrics_server(&g_aesdsocket) == FAILURE) {
+        exit(-1);
+    }
 
-    if (daemon_mode) {
+    if (g_aesdsocket.config.daemon_mode) {
         syslog(LOG_DEBUG, "starting aesdsocket in daemon mode.");
         pid_t pid = fork();
         switch(pid) {
@@ -483,47 +5790,59 @@ int main(int argc, char* argv[]) {
         }
     }
 
-    // Spawn the timestamp thread
-    if (pthread_create(&g_aesdsocket.timestamp_thread, NULL, manage_timestamp_thread, NULL) != 0) {
+    // Threads don't survive the fork, so the log thread starts in the daemon.
+    pthread_t log_thread_id;
+    if (pthread_create(&log_thread_id, NULL, manage_log_thread, &g_aesdsocket.log) != 0) {
         perror("pthread_create");
         exit(-1);
     }
+    pthread_detach(log_thread_id);
 
-    while(true) {
-        int peer_fd = accept(g_aesdsocket.server_fd, (struct sockaddr*)&g_aesdsocket.address, &address_length);
-        if (peer_fd == -1) {
-            perror("accept failed");
-            syslog(LOG_ERR, "accept failed");
-            exit(-1);
-        }
+    g_aesdsocket.signal_fd = signalfd(-1, &shutdown_signals, SFD_CLOEXEC);
+    g_aesdsocket.shutdown_fd = eventfd(0, EFD_CLOEXEC);
+    if (g_aesdsocket.signal_fd == -1 || g_aesdsocket.shutdown_fd == -1) {
+        perror("signalfd/eventfd");
+        exit(-1);
+    }
 
-        // Spawn a new thread to handle the accepted connection.
-        connection_thread_args_t* thread_args = malloc(sizeof(connection_thread_args_t));
-        thread_args->id = g_aesdsocket.metrics.total_connections;
-        thread_args->peer_fd = peer_fd;
-        pthread_t new_thread_id;
-        if (pthread_create(&new_thread_id, NULL, manage_connection_thread, thread_args) != 0) {
-            perror("pthread_create");
-            exit(-1);
-        }
+    if (history_init(&g_aesdsocket.history, &g_aesdsocket.config) == FAILURE) {
+        exit(-1);
+    }
 
-        // Add an entry for this new thread into the global aesdsocket structure.
-        connection_entry_t *new_connection = malloc(sizeof(connection_entry_t));
-        new_connection->id = g_aesdsocket.metrics.total_connections;
-        new_connection->peer_fd = peer_fd;
-        new_connection->thread_id = new_thread_id;
-        new_connection->done = false;
+    if (housekeeping_start(&g_aesdsocket) == FAILURE) {
+        exit(-1);
+    }
 
-        pthread_mutex_lock(&g_aesdsocket.connections_mutex);
-        SLIST_INSERT_HEAD(&g_aesdsocket.connections, new_connection, entries);
-        g_aesdsocket.connections_count += 1;
-        g_aesdsocket.metrics.total_connections += 1;
-        int connections_count = g_aesdsocket.connections_count;
-        pthread_mutex_unlock(&g_aesdsocket.connections_mutex);
+    // Signals that came in during startup stay pending until this thread reads them.
+    pthread_t signal_thread_id;
+    if (pthread_create(&signal_thread_id, NULL, manage_signal_thread, &g_aesdsocket) != 0) {
+        perror("pthread_create");
+        exit(-1);
+    }
+    pthread_detach(signal_thread_id);
 
-        syslog(LOG_DEBUG, "new connection. connections_count: %d (all time: %d)",
-            connections_count, g_aesdsocket.metrics.total_connections);
+    if (g_aesdsocket.metrics.server_fd != -1) {
+        pthread_t metrics_thread_id;
+        if (pthread_create(&metrics_thread_id, NULL, manage_metrics_thread, &g_aesdsocket) != 0) {
+            perror("pthread_create");
+            exit(-1);
+        }
+        pthread_detach(metrics_thread_id);
+    }
 
-        join_completed_threads(&g_aesdsocket);
+    result_t result;
+    if (g_aesdsocket.config.mode == SERVER_MODE_THREAD) {
+        result = run_thread_server(&g_aesdsocket);
+    } else if (g_aesdsocket.config.mode == SERVER_MODE_POOL) {
+        result = run_pool_server(&g_aesdsocket);
+    } else if (g_aesdsocket.config.mode == SERVER_MODE_URING) {
+        result = run_uring_server(&g_aesdsocket);
+    } else {
+        result = run_event_loop_server(&g_aesdsocket);
+    }
+    if (result == FAILURE) {
+        exit(-1);
     }
+    cleanup_and_exit(&g_aesdsocket);
+    return 0;
 }
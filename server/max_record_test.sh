@@ -0,0 +1,55 @@
+#
+# Sandbox regression test for --max-record: records longer than the limit close the
+# connection without being appended, whether they arrive in one read or several, and
+# take the complete records of their read along with them.
+# Starts its own aesdsocket on port 9000, run it from the server directory after make.
+#
+
+port=9000
+max_record=100
+failures=0
+
+function exchange {
+    # Send $1 and print whatever comes back before the server closes the connection.
+    exec 3<>/dev/tcp/localhost/${port}
+    printf "%s" "$1" >&3
+    timeout 2 cat <&3
+    exec 3<&-
+}
+
+function expect {
+    local description=$1
+    local expected=$2
+    local actual=$3
+    if [ "${actual}" == "${expected}" ]; then
+        echo "PASS: ${description}"
+    else
+        echo "FAIL: ${description}: got ${#actual} bytes"
+        failures=$((failures + 1))
+    fi
+}
+
+rm -f /var/tmp/aesdsocketdata*
+./aesdsocket --max-record ${max_record} &
+server_pid=$!
+sleep 0.5
+
+long=$(head -c 5000 /dev/zero | tr '\0' 'x')
+fits=$(head -c $((max_record - 1)) /dev/zero | tr '\0' 'y')
+
+expect "record within the limit" "first" "$(exchange $'first\n')"
+expect "oversized record in one read" "" "$(exchange "${long}"$'\n')"
+expect "oversized record ahead of a short one" "" "$(exchange "${long}"$'\nshort\n')"
+expect "complete record ahead of an oversized unterminated one" "" "$(exchange $'ok\n'"${long}")"
+expect "record of exactly the limit" $'first\n'"${fits}" "$(exchange "${fits}"$'\n')"
+expect "nothing of the rejected records was appended" $'first\n'"${fits}"$'\nlast' "$(exchange $'last\n')"
+
+kill -TERM ${server_pid}
+wait ${server_pid}
+
+if [ ${failures} -ne 0 ]; then
+    echo "${failures} failed"
+    exit 1
+fi
+echo "done"
+exit 0